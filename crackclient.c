@@ -7,6 +7,16 @@
 #include <csse2310a3.h>
 
 #define BUFFER_SIZE 50
+#define MAX_PHRASE_SIZE 8
+#define MAX_CIPHER_SIZE 13
+#define SALT_SIZE 2
+#define BIN_HANDSHAKE "binary\n"
+#define BIN_HEADER_SIZE 8
+#define BIN_MAX_FRAME 4096
+#define BIN_CRYPT_SIZE 10
+#define BIN_CRYPT_RESULT_SIZE 14
+#define BIN_CRACK_SIZE 14
+#define BIN_CRACK_RESULT_SIZE 9
 
 // Enumerated type holding exit status information.
 typedef enum {	
@@ -16,14 +26,38 @@ typedef enum {
     PORT_CONNECT_ERROR = 3,
     SERVER_TERMINATED_ERROR = 4,
     ADDR_INFO_ERROR = 5, 
+    BINARY_ERROR = 6,
 } ExitStatus;
 
+// Enumerated type with the kinds of binary protocol frame (see crackserver)
+typedef enum {
+    BIN_CRYPT = 1,
+    BIN_CRACK = 2,
+    BIN_ERROR = 255,
+} BinaryFrameType;
+
+// Enumerated type with the status of each request in a binary response
+typedef enum {
+    BIN_OK = 0,
+    BIN_FAILED = 1,
+    BIN_INVALID = 2,
+} BinaryStatus;
+
 // Structure to hold program parameters obtained from the command line.
 typedef struct {
     char* port;
     char* jobFile;
+    bool binary;
 } ProgramParams;
 
+// Structure to hold the requests waiting to be sent together in one binary
+// frame, all of the same type.
+typedef struct {
+    BinaryFrameType type;
+    int count;
+    unsigned char frame[BIN_MAX_FRAME];
+} BinaryBatch;
+
 // Function prototypes - see functions for their descriptions
 void args_error(void);
 void job_file_error(char* jobFile);
@@ -32,6 +66,9 @@ int connect_to_port(ProgramParams params);
 void process_job_commands(FILE* jobs, int socketFd, int stream);
 void server_terminated_error(void);
 void respond_to_server(FILE* to, FILE* from);
+void process_binary_jobs(FILE* jobs, int socketFd, int stream);
+BinaryFrameType encode_job(char* job, unsigned char* record);
+void send_binary_batch(BinaryBatch* batch, FILE* to, FILE* from);
 
 /*****************************************************************************/
 int main(int argc, char* argv[]) {
@@ -52,6 +89,9 @@ int main(int argc, char* argv[]) {
     // try and connect to port supplied
     socketFd = connect_to_port(params);
     //process_job_commands(jobs, socketFd, stream);
+    if (params.binary) {
+	process_binary_jobs(jobs, socketFd, stream);
+    }
     process_job_commands(jobs, socketFd, stream);
 
     return 0;
@@ -60,7 +100,7 @@ int main(int argc, char* argv[]) {
 // Function that prints the args error message and exits with a non zero exit
 // status
 void args_error() {
-    fprintf(stderr, "Usage: crackclient portnum [jobfile]\n");
+    fprintf(stderr, "Usage: crackclient [--binary] portnum [jobfile]\n");
     exit(ARGS_ERROR);
 }
 
@@ -139,17 +179,163 @@ void process_job_commands(FILE* jobs, int socketFd, int stream) {
     }
 }
 
+// Function to process the job commands over the binary protocol, takes in
+// the same arguments as process_job_commands(). Consecutive crypt or crack
+// commands from a job file are sent together in one frame, commands read
+// from stdin are sent one at a time. Commands that cannot be sent are
+// reported as errors straight away, in order. Exits once every command has
+// been answered.
+void process_binary_jobs(FILE* jobs, int socketFd, int stream) {
+
+    char buffer[80];
+    unsigned char record[BIN_CRYPT_SIZE > BIN_CRACK_SIZE ? BIN_CRYPT_SIZE
+	    : BIN_CRACK_SIZE];
+    FILE* to = fdopen(dup(socketFd), "w");
+    FILE* from = fdopen(socketFd, "r");
+    FILE* in = stream == 1 ? jobs : stdin;
+    BinaryBatch batch;
+    batch.count = 0;
+    fprintf(to, BIN_HANDSHAKE);
+    fflush(to);
+    if (fgets(buffer, BUFFER_SIZE, from) == NULL) {
+	server_terminated_error();
+    } else if (strcmp(buffer, BIN_HANDSHAKE) != 0) {
+	fprintf(stderr, "crackclient: server does not support --binary\n");
+	exit(BINARY_ERROR);
+    }
+    while (fgets(buffer, BUFFER_SIZE, in) != NULL) {
+	if (buffer[0] == '#' || strlen(buffer) < 1 || buffer[0] == '\n') {
+	    continue;
+	}
+	BinaryFrameType type = encode_job(buffer, record);
+	int size = type == BIN_CRYPT ? BIN_CRYPT_SIZE : BIN_CRACK_SIZE;
+	if (batch.count > 0 && (type != batch.type || BIN_HEADER_SIZE
+		+ (batch.count + 1) * size > BIN_MAX_FRAME)) {
+	    send_binary_batch(&batch, to, from);
+	}
+	if (type == BIN_ERROR) {
+	    printf("Error in command\n");
+	    fflush(stdout);
+	    continue;
+	}
+	batch.type = type;
+	memcpy(batch.frame + BIN_HEADER_SIZE + batch.count * size, record,
+		size);
+	batch.count++;
+	if (stream == 2) {
+	    send_binary_batch(&batch, to, from);
+	}
+    }
+    if (batch.count > 0) {
+	send_binary_batch(&batch, to, from);
+    }
+    fclose(to);
+    fclose(from);
+    exit(NORMAL_EXIT);
+}
+
+// Function that encodes a job command as a binary request record. Takes in
+// the command and where to write the record. A field that is missing or
+// does not fit is left zeroed, which the server answers as invalid (and
+// counts, as it would the text command). Returns the type of frame the
+// record goes in, or BIN_ERROR if it is not a crypt or crack command with
+// one or two arguments.
+BinaryFrameType encode_job(char* job, unsigned char* record) {
+
+    char* args[4] = {0};
+    int length = 0;
+    char* saveptr;
+    for (char* arg = strtok_r(job, " \n", &saveptr); arg && length < 4;
+	    arg = strtok_r(NULL, " \n", &saveptr)) {
+	args[length++] = arg;
+    }
+    if (length < 2 || length > 3) {
+	return BIN_ERROR;
+    }
+    if (!strcmp(args[0], "crypt")) {
+	memset(record, 0, BIN_CRYPT_SIZE);
+	if (length == 3 && strlen(args[1]) <= MAX_PHRASE_SIZE
+		&& strlen(args[2]) == SALT_SIZE) {
+	    memcpy(record, args[1], strlen(args[1]));
+	    memcpy(record + MAX_PHRASE_SIZE, args[2], SALT_SIZE);
+	}
+	return BIN_CRYPT;
+    }
+    if (!strcmp(args[0], "crack")) {
+	memset(record, 0, BIN_CRACK_SIZE);
+	if (strlen(args[1]) <= MAX_CIPHER_SIZE) {
+	    memcpy(record, args[1], strlen(args[1]));
+	}
+	if (length == 3 && strlen(args[2]) <= 3
+		&& strspn(args[2], "0123456789") == strlen(args[2])
+		&& atoi(args[2]) <= 255) {
+	    record[MAX_CIPHER_SIZE] = atoi(args[2]);
+	}
+	return BIN_CRACK;
+    }
+    return BIN_ERROR;
+}
+
+// Function that sends a batch of requests as one binary frame, then waits
+// for the response frame and prints each result as the text protocol
+// would. Takes in the batch (which is emptied) and the streams to and from
+// the server.
+void send_binary_batch(BinaryBatch* batch, FILE* to, FILE* from) {
+
+    unsigned char header[BIN_HEADER_SIZE];
+    unsigned char result[BIN_CRYPT_RESULT_SIZE];
+    int size = batch->type == BIN_CRYPT ? BIN_CRYPT_SIZE : BIN_CRACK_SIZE;
+    int resultSize = batch->type == BIN_CRYPT ? BIN_CRYPT_RESULT_SIZE
+	    : BIN_CRACK_RESULT_SIZE;
+    int length = batch->count * size;
+    unsigned char* frame = batch->frame;
+    // Length and count are big endian
+    frame[0] = length >> 24;
+    frame[1] = length >> 16;
+    frame[2] = length >> 8;
+    frame[3] = length;
+    frame[4] = batch->type;
+    frame[5] = 0;
+    frame[6] = batch->count >> 8;
+    frame[7] = batch->count;
+    fwrite(frame, 1, BIN_HEADER_SIZE + length, to);
+    fflush(to);
+    if (fread(header, 1, BIN_HEADER_SIZE, from) != BIN_HEADER_SIZE
+	    || header[4] != batch->type) {
+	server_terminated_error();
+    }
+    for (int i = 0; i < batch->count; i++) {
+	if (fread(result, 1, resultSize, from) != resultSize) {
+	    server_terminated_error();
+	}
+	if (result[0] == BIN_INVALID) {
+	    printf("Error in command\n");
+	} else if (result[0] == BIN_FAILED) {
+	    printf("Unable to decrypt\n");
+	} else {
+	    printf("%.*s\n", resultSize - 1, (char*)result + 1);
+	}
+    }
+    fflush(stdout);
+    batch->count = 0;
+}
+
 // Function to process the command line arguments, takes in argc the number
 // of arguments, argv[] the list of commands as strings. Prints out error
 // messages if commands are invalid or returns a ProgramParams struct 
 // containing valid commands.
 ProgramParams process_command_line(int argc, char* argv[]) {
     
-    ProgramParams params = { .port = 0, .jobFile = 0 };
+    ProgramParams params = { .port = 0, .jobFile = 0, .binary = false };
     
     // Skip over the program name argument (./crackclient)
     argc--;
     argv++;
+    if (argc >= 1 && !strcmp(argv[0], "--binary")) {
+	params.binary = true;
+	argc--;
+	argv++;
+    }
     if (argc < 1 || argc > 2) {
 	args_error();
     } else if (argc == 2) {
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,71 +14,804 @@
 #include <netdb.h>
 #include <signal.h>
 #include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <poll.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define HAVE_IO_URING 1
+#endif
+#endif
 
 #define BUFFER_SIZE 50
 #define SALT_SIZE 2
 #define MAX_PHRASE_SIZE 8
+#define DICT_MIN_CHUNK 1048576
+#define DICT_MAX_LOADERS 16
+#define DICT_PREFETCH 16
+#define SNAPSHOT_MAGIC "CRKDICT\n"
+#define SNAPSHOT_VERSION 2
+#define TABLES_MAGIC "CRKTABL\n"
+#define TABLES_VERSION 1
+#define DICT_SLOT_ALIGN 64
+#define MAX_WEIGHT_DIGITS 18
 #define MAX_CIPHER_SIZE 13
 #define MAX_NUM_LENGTH 6
 #define MIN_PORT 1024
 #define MAX_PORT 65535
+#define CRACK_CHUNK_BATCHES 4
+#define CACHE_SHARDS 64
+#define CACHE_SHARD_ENTRIES 1024
+#define CACHE_SHARD_BUCKETS 2048
+#define POTFILE_INDEX_MAGIC "CRKPIDX\n"
+#define POTFILE_INDEX_VERSION 1
+#define POTFILE_MIN_ENTRIES 1024
+#define POTFILE_CHECK_SIZE 64
+#define SALT_COMBINATIONS 4096
+#define DES_ROUNDS 16
+#define CRYPT_ITERATIONS 25
+#define CRYPT_MAX_BATCH 512
+#define STATS_SHARDS 64
+#define STATS_LINE_SIZE 64
+#define STATS_FLUSH_CALLS 4096
+#define MAX_IO_THREADS 4
+#define IO_EVENTS 64
+#define CONN_BUFFER_SIZE 4096
+#define CONN_WRITE_LIMIT 65536
+#define IO_RING_ENTRIES 256
+#define IO_RING_BUFFERS 512
+#define IO_RING_BUFFER_SIZE 256
+#define MAX_TAG_SIZE 16
+#define TAG_MARKER '@'
+#define MAX_NAME_LABEL 64
+#define MAX_RULE_OPS 16
+#define RULE_LINE_SIZE 256
+#define MAX_MASK_SIZE (2 * MAX_PHRASE_SIZE)
+#define COMBINE_TILE_LEFT 8
+#define COMBINE_TILE_RIGHT 64
+#define SLOT_ONES 0x0101010101010101ULL
+#define SLOT_LOW_BITS 0x7f7f7f7f7f7f7f7fULL
+#define SLOT_HIGH_BITS 0x8080808080808080ULL
+#define BIN_HANDSHAKE "binary\n"
+#define BIN_HEADER_SIZE 8
+#define BIN_MAX_FRAME CONN_BUFFER_SIZE
+#define BIN_CRYPT_SIZE 10
+#define BIN_CRYPT_RESULT_SIZE 14
+#define BIN_CRACK_SIZE 14
+#define BIN_CRACK_RESULT_SIZE 9
+#define BIN_MAX_RESPONSE (BIN_HEADER_SIZE + BIN_MAX_FRAME / BIN_CRYPT_SIZE\
+	* BIN_CRYPT_RESULT_SIZE)
+#define CRYPT_ALPHABET "./0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ"\
+	"abcdefghijklmnopqrstuvwxyz"
 #define CHAR_SET "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ./"\
 	"0123456789"
 
+// Enumerated type with the ways client connections can be served - a thread
+// per client, a few I/O threads multiplexing every client with epoll, or a
+// single thread doing every accept, recv and send through io_uring
+typedef enum {
+    IO_THREADS = 0,
+    IO_EPOLL = 1,
+    IO_URING = 2,
+} IoModel;
+
+// Enumerated type with the kinds of binary protocol frame. A frame is an 8
+// byte header - its length (after the header) as a big endian 32 bit
+// value, its type, a zero byte and its count of records as a big endian
+// 16 bit value - then its records. A crypt request is the word (NUL
+// padded to 8 bytes) then the salt, a crack request is the 13 character
+// ciphertext then its thread count as a byte. Each response frame has a
+// result per request, in order: a BinaryStatus byte then the 13 character
+// ciphertext or the word (NUL padded to 8 bytes) cracked.
+typedef enum {
+    BIN_CRYPT = 1,
+    BIN_CRACK = 2,
+    BIN_ERROR = 255,
+} BinaryFrameType;
+
+// Enumerated type with the status of each request in a binary response
+typedef enum {
+    BIN_OK = 0,
+    BIN_FAILED = 1,
+    BIN_INVALID = 2,
+} BinaryStatus;
+
+// Structure to hold a file given with --dictionary or --rules: the name
+// crack requests select it by (NULL if it was given without one) and the
+// file itself
+typedef struct {
+    char* name;
+    char* fileName;
+} NamedFile;
+
 // Structure to hold the program parameters - obtained from the command lin
+// The first of the dictionaries is the default dictionary.
 typedef struct {
     int connections; 
     const char* port;
-    char* fileName;
+    NamedFile* dictionaries;
+    int numDictionaries;
+    NamedFile* ruleSets;
+    int numRuleSets;
+    int workers;
+    bool benchmark;
+    char* backend;
+    IoModel ioModel;
+    bool ioModelSet;
+    char* snapshotName;
+    char* potfileName;
+    char* importName;
+    char* precomputeName;
+    char* tablesName;
 } ProgramParams;
 
-//Structure that acts as a dictionary
+// Structure to hold a dictionary's words grouped by length, for combinator
+// crack requests. slots holds every word, shortest first, and the words of
+// length n are those from starts[n] up to starts[n + 1]. groupPairs[n] is
+// the number of pairs of words whose first word has length n and that fit
+// in MAX_PHRASE_SIZE characters joined together, numPairs the total.
+typedef struct {
+    uint64_t* slots;
+    int starts[MAX_PHRASE_SIZE + 2];
+    long groupPairs[MAX_PHRASE_SIZE + 1];
+    long numPairs;
+} LengthBuckets;
+
+// Structure to hold how many ciphertexts each word of a dictionary file has
+// cracked, learned from the server's own matches and kept across reloads,
+// so each load of the file can put the words that crack most first. It is
+// an open addressing table of words, a count of zero marking a free slot,
+// protected by lock.
+typedef struct {
+    sem_t lock;
+    int capacity;
+    int numWords;
+    uint64_t* words;
+    long* counts;
+} WordHits;
+
+// Structure to hold an entry of a salt's precomputed table: the top 32 bits
+// (the fingerprint) of a word's raw crypt(3) result with the salt, and the
+// index of the word in the dictionary.
+typedef struct {
+    uint32_t fingerprint;
+    uint32_t word;
+} TableEntry;
+
+// Structure to hold the mapped tables file written by --precompute for a
+// dictionary: the table of every salt, one after another, each with an
+// entry for each of numWords words sorted by fingerprint.
+typedef struct {
+    char* data;
+    size_t size;
+    int numWords;
+    TableEntry* entries;
+} CrackTables;
+
+//Structure that acts as a dictionary. Every word fits in MAX_PHRASE_SIZE
+// characters, so each is stored in an 8 byte slot (its characters in
+// order, padded with zero bytes) and the slots are one dense array,
+// aligned to DICT_SLOT_ALIGN, that is hashed in batches as it is. The
+// slots of a snapshot are used where they are in snapshot, its contents
+// (mapped if snapshotMapped), rather than copied. byLength is only built
+// the first time a combinator request uses the dictionary. hits is where
+// matches with the dictionary's words are learned (NULL if they are not).
+// generation is different for every dictionary loaded. tables are the
+// precomputed tables given with --tables for the dictionary loaded at
+// startup (NULL for any other).
+// A dictionary served to clients is freed once refs, its references, drops
+// to zero.
 typedef struct {
     int numWords;
-    char** words;
+    uint64_t* slots;
+    char* snapshot;
+    size_t snapshotSize;
+    bool snapshotMapped;
+    LengthBuckets* byLength;
+    WordHits* hits;
+    long generation;
+    CrackTables* tables;
+    int refs;
 } Dictionary;
 
-// Structure that stores statistics related to client requests.
+// Structure to hold the dictionary that new crack requests use, which
+// SIGUSR1 replaces with a freshly loaded copy of fileName, along with the
+// reload statistics. A pass holds a reference to the dictionary it was
+// created for, so passes already running finish on the old dictionary,
+// which is freed once the last of them is. name is the first name the
+// file was given (NULL for the default dictionary given without one).
+// current and the statistics are protected by lock. hits is shared by
+// every dictionary loaded from the file. tablesName is the --tables file
+// of the default dictionary (NULL for any other), mapped again for each
+// dictionary it is reloaded as.
+typedef struct {
+    char* name;
+    char* fileName;
+    char* tablesName;
+    Dictionary* current;
+    WordHits hits;
+    sem_t lock;
+    bool reloading;
+    long reloads;
+    long failedReloads;
+    double reloadSeconds;
+    int previousWords;
+} DictionarySource;
+
+// Structure to hold every dictionary the server serves. sources has one
+// entry for each distinct file, loaded once and shared by every worker,
+// the first being the default dictionary. named holds the source of each
+// of the names.
+typedef struct {
+    int numSources;
+    DictionarySource** sources;
+    int numNames;
+    char** names;
+    DictionarySource** named;
+} DictionarySet;
+
+// Structure to hold one operation of a word mangling rule: its command
+// character and up to two arguments (a character or a position)
+typedef struct {
+    char command;
+    unsigned char arg1;
+    unsigned char arg2;
+} RuleOp;
+
+// Structure to hold a word mangling rule, applied to each dictionary word
+// one operation after another
+typedef struct {
+    int numOps;
+    RuleOp ops[MAX_RULE_OPS];
+} Rule;
+
+// Structure to hold a rule set loaded with --rules. A crack request using
+// it tries every rule on every word, rule by rule. identity is the first
+// rule that leaves every word as it is (-1 if there is none).
+typedef struct {
+    char* name;
+    int numRules;
+    Rule* rules;
+    int identity;
+} RuleSet;
+
+// Structure to hold one fixed length part of a keyspace mask: the
+// characters each position may take (sets[i], or just literals[i] if it is
+// NULL) and how many candidates the part holds.
+typedef struct {
+    int length;
+    const char* sets[MAX_PHRASE_SIZE];
+    int sizes[MAX_PHRASE_SIZE];
+    char literals[MAX_PHRASE_SIZE];
+    long numCandidates;
+} MaskPart;
+
+// Structure to hold the keyspace of a brute force crack request - a mask
+// such as ?l?l?d (one part) or a range of lengths of CHAR_SET words such as
+// 1-4 (a part for each length). Candidate indexes run through the parts in
+// order, and within a part the first position changes fastest, so any
+// index can be turned into its candidate without looking at any other.
+typedef struct {
+    char text[MAX_MASK_SIZE + 1];
+    int numParts;
+    MaskPart parts[MAX_PHRASE_SIZE + 1];
+    long numCandidates;
+} Mask;
+
+// Structure to hold the header of a dictionary snapshot, a dictionary
+// written by --compile-dictionary to be mapped as it is. The header is
+// followed by the slots, exactly as a Dictionary holds them, which
+// checksum covers. The header's size keeps the slots aligned.
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t numWords;
+    uint64_t checksum;
+    uint64_t reserved[5];
+} DictionarySnapshot;
+
+// Structure to hold the header of a tables file written by --precompute,
+// followed by the tables themselves. checksum is the checksum of the
+// dictionary's slots the tables were built from, as for a snapshot.
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t numWords;
+    uint64_t checksum;
+    uint64_t reserved[5];
+} TableHeader;
+
+// Structure to hold one loader thread's share of a dictionary file while it
+// is loaded: the lines from start to end. The thread packs each word (of at
+// most MAX_PHRASE_SIZE characters) of its lines into a key (its slot),
+// noting which thread's partition of the key space it is in, and the
+// weight of each key whose line gives one (weights is NULL if no line
+// does). It then marks which keys of its own partition repeat an earlier
+// word, and finally copies the slots of the words kept from its lines to
+// the dictionary from firstWord on.
+typedef struct DictionaryChunk {
+    struct DictionaryLoad* load;
+    int index;
+    const char* start;
+    const char* end;
+    uint64_t* keys;
+    long* weights;
+    unsigned char* partitions;
+    int numKeys;
+    int firstKey;
+    int numWords;
+    int firstWord;
+} DictionaryChunk;
+
+// Structure to hold the state shared by the threads loading a dictionary.
+// repeated has a flag for each key, in file order, set for every key but
+// the first of each word. weights has the weight of each word kept, if any
+// line gives a weight.
+typedef struct DictionaryLoad {
+    int numChunks;
+    DictionaryChunk* chunks;
+    bool* repeated;
+    long* weights;
+    Dictionary* dict;
+} DictionaryLoad;
+
+// Structure to hold a key of a loader thread's partition while it looks for
+// repeated words: the key, its hash and its index in the file's keys.
+typedef struct {
+    uint64_t key;
+    unsigned int hash;
+    int index;
+} PartitionKey;
+
+// Structure that stores one shard of the statistics related to client
+// requests. Each thread only adds to the shard it was given, and each shard
+// has a cache line to itself so threads never contend for one.
+typedef struct {
+    long connectedClients;
+    long completedClients;
+    long crackRequests;
+    long failedRequests;
+    long successfulRequests;
+    long cryptRequests;
+    long cryptCalls;
+    long cacheHits;
+    long cacheMisses;
+    long cacheEvictions;
+} __attribute__((aligned(STATS_LINE_SIZE))) StatsShard;
+
+// Structure that stores statistics related to client requests, the totals
+// are the sums over every shard.
 typedef struct {
-    volatile int connectedClients;
-    volatile int completedClients;
-    volatile int crackRequests;
-    volatile int failedRequests;
-    volatile int successfulRequests;
-    volatile int cryptRequests;
-    volatile int cryptCalls;
+    StatsShard shards[STATS_SHARDS];
+    int nextShard;
 } Statistics;
 
-// Structure to hold information relevant to each thread performing
-// a cracking request.
-struct CrackCommInfo {
-    volatile int* startIndex;
-    volatile bool* found;
-    volatile int* threadsInitiated;
-    int numThreads;
+// Vector types holding one bit of the DES state for each of their lanes, as
+// used by the bitsliced crypt kernels.
+typedef uint64_t BitVector64 __attribute__((vector_size(8)));
+typedef uint64_t BitVector128 __attribute__((vector_size(16)));
+typedef uint64_t BitVector256 __attribute__((vector_size(32)));
+typedef uint64_t BitVector512 __attribute__((vector_size(64)));
+
+// Structure to hold the salt independent tables used by the crypt backends.
+// For the bitsliced kernels, the key bit of every subkey bit in each round
+// and the bit of L that each S-box output bit is xored into (all 0 based).
+// For the scalar DES engine, C and D contributed by each key character, the
+// subkey bits contributed by each 7 bit group of C and D and each S-box
+// combined with the permutation of its output.
+typedef struct {
+    int keyBits[DES_ROUNDS][48];
+    int sBoxTarget[32];
+    uint64_t keyChoice[MAX_PHRASE_SIZE][128];
+    uint64_t subkeyChoice[8][128];
+    uint32_t sBoxPermuted[8][64];
+} DesTables;
+
+// Structure describing a crypt backend. create() makes the state a thread
+// hashes with, init_salt() sets it up for a salt once, then hash_batch()
+// stores the raw 64 bit traditional crypt(3) result of up to batchSize
+// words, each given as a dictionary slot. Bitsliced backends also name the
+// instruction set their kernel needs (NULL if none).
+typedef struct CryptBackend {
+    const char* name;
+    const char* isa;
+    int batchSize;
+    void (*kernel)(const uint64_t* words, int count,
+	    const DesTables* tables, const int* expansion, uint64_t* results);
+    void* (*create)(const struct CryptBackend* backend);
+    void (*init_salt)(void* state, const char* salt);
+    void (*hash_batch)(void* state, const uint64_t* words, int count,
+	    uint64_t* results);
+} CryptBackend;
+
+// Structure to hold the state shared by the --precompute threads: the
+// dictionary and backend to hash it with, the temporary tables file they
+// write to, the next salt to be taken and whether any write failed.
+typedef struct {
+    Dictionary* dict;
+    const CryptBackend* backend;
+    int fd;
+    int nextSalt;
+    bool failed;
+} TableBuild;
+
+// Structure to hold a single client's cracking request while it waits on
+// the dictionary pass for its salt. It lives on the requesting client
+// thread's stack (or in its connection), fields other than done are
+// protected by the pool's schedLock. The request is answered once a match
+// is found or once every word in its window of pass positions has been
+// checked - by posting done (and bumping wakeFd, the waiting client
+// thread's eventfd), or if set by calling complete (with the schedLock
+// held) so an I/O thread need not block. A request whose client
+// has gone is answered straight away with cancelled set. job is the pass
+// the request is waiting on, NULL once it has been answered. Requests for
+// the same ciphertext on a pass share one window, so the pass only stops
+// for them once the last is cancelled.
+typedef struct CrackWaiter {
     char* cipherText;
-    Statistics* stats;
-    sem_t* dataSem;
+    int weight;
+    long joinPosition;
+    long remaining;
+    bool found;
+    char result[MAX_PHRASE_SIZE + 1];
+    struct CrackWaiter* next;
+    sem_t done;
+    int wakeFd;
+    void (*complete)(struct CrackWaiter* waiter);
+    void* owner;
+    struct CrackJob* job;
+    bool cancelled;
+} CrackWaiter;
+
+// Structure to hold the set of ciphertexts waiting on a pass, as raw 64 bit
+// crypt(3) results so they can be compared before encoding. A set is never
+// changed once built, it is replaced whenever the waiters change and freed
+// when the last chunk using it is done (refs is protected by the pool's
+// schedLock).
+typedef struct {
+    int refs;
+    int mask;
+    uint64_t* slots;
+    bool* used;
+} CipherSet;
+
+// Structure to hold a pass over the dictionary shared by every pending
+// crack request with the same salt (and dictionary and rule set, or mask),
+// so each crypt_r() result is checked against all of their ciphertexts.
+// The pass tries numCandidates candidates - each word of the dictionary,
+// with a rule set each rule on each word, rule by rule, if combine is set
+// each pair of words that fits joined together, or with a mask (and no
+// dictionary) every word of its keyspace. Positions count
+// candidates handed out since the pass started and wrap around the
+// candidates. All fields are
+// protected by the pool's schedLock, apart from active - the cancel token
+// that workers cracking the pass's chunks check (with an acquire load)
+// every batch, cleared once the pass has no waiters left.
+typedef struct CrackJob {
+    bool active;
+    char salt[SALT_SIZE + 1];
+    int saltIndex;
     Dictionary* dict;
-};
+    RuleSet* rules;
+    Mask* mask;
+    bool combine;
+    long numCandidates;
+    CrackWaiter* waiters;
+    CipherSet* cipherSet;
+    uint64_t scope;
+    int weight;
+    int credit;
+    long nextPosition;
+    long endPosition;
+    int chunksOutstanding;
+    bool runnable;
+    struct CrackJob* prev;
+    struct CrackJob* next;
+    struct CrackJob* sameSalt;
+} CrackJob;
+
+// Structure to hold one chunk of a pass's candidates, claimed by a worker
+// along with the cipher set current at the time.
+typedef struct {
+    CrackJob* job;
+    CipherSet* cipherSet;
+    long startPosition;
+    long startIndex;
+    long endIndex;
+} CrackTask;
+
+// Structure to hold the cached answer to a crack request for a ciphertext:
+// its word if it was found (which holds for any request), or else the
+// scope - the candidates a request went through without a match. prev and
+// next link the entries of a cache shard from newest to oldest use, chain
+// links the entries of a hash bucket (-1 ends a list).
+typedef struct {
+    char cipherText[MAX_CIPHER_SIZE + 1];
+    bool found;
+    char result[MAX_PHRASE_SIZE + 1];
+    uint64_t scope;
+    int prev;
+    int next;
+    int chain;
+} CacheEntry;
+
+// Structure to hold one shard of the crack cache, a bounded hash table of
+// CACHE_SHARD_ENTRIES entries that evicts the least recently used entry
+// when full. Everything is protected by lock.
+typedef struct {
+    sem_t lock;
+    int numEntries;
+    int newest;
+    int oldest;
+    int buckets[CACHE_SHARD_BUCKETS];
+    CacheEntry entries[CACHE_SHARD_ENTRIES];
+} CacheShard;
+
+// Structure to hold the answers to recent crack requests, so a repeated
+// request is answered without a pass. Ciphertexts are spread over the
+// shards by hash, so requests for different ciphertexts rarely contend.
+typedef struct {
+    CacheShard shards[CACHE_SHARDS];
+} CrackCache;
+
+// Structure to hold a cracked ciphertext in a potfile's index, an open
+// addressed hash table: its salt (as its 12 bits plus one, 0 for an empty
+// entry), raw crypt(3) result and the word (as a slot) that gives it.
+typedef struct {
+    uint64_t result;
+    uint64_t word;
+    uint32_t salt;
+    uint32_t reserved;
+} PotEntry;
+
+// Structure to hold the header of a potfile's index file, written next to
+// the potfile so a restart need not parse every record again. The header
+// is followed by the capacity entries, which checksum covers. covered is
+// the length of the potfile whose records are all in the index, and
+// tailChecksum the checksum of the last bytes of that length, so an index
+// of some other potfile is never used.
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t numEntries;
+    uint64_t capacity;
+    uint64_t covered;
+    uint64_t tailChecksum;
+    uint64_t checksum;
+    uint64_t reserved[2];
+} PotIndexHeader;
+
+// Structure to hold the potfile - an append only log of every ciphertext
+// ever cracked, as "ciphertext:word" lines, open for appending on fd -
+// and its index, protected by lock. Appends are serialised by writeLock
+// instead, so lookups never wait on the disk. The entries are the mapped
+// index file until the index grows. covered is the length of the potfile
+// that was indexed when it was opened.
+typedef struct {
+    char* fileName;
+    char* indexName;
+    int fd;
+    sem_t lock;
+    sem_t writeLock;
+    PotEntry* entries;
+    long capacity;
+    long numEntries;
+    size_t covered;
+    void* mapping;
+    size_t mappingSize;
+} Potfile;
+
+// Structure holding the long-lived crack worker threads, the ring of passes
+// that still have chunks to hand out and every pending pass by salt.
+// chunkSize is the number of candidates in a chunk.
+typedef struct {
+    int numWorkers;
+    int idleWorkers;
+    int chunkSize;
+    pthread_t* tids;
+    CrackJob* current;
+    CrackJob* passes[SALT_COMBINATIONS];
+    sem_t schedLock;
+    sem_t workAvailable;
+    Statistics* stats;
+    DictionarySet* dictionaries;
+    int numRuleSets;
+    RuleSet* ruleSets;
+    const CryptBackend* backend;
+    const CryptBackend* cryptBackend;
+    CrackCache* cache;
+    Potfile* potfile;
+} WorkerPool;
 
 // Structure to hold information required by the stats_on_sighup thread
 // function
 struct SigInfo {
     Statistics* stats;
+    DictionarySet* dictionaries;
     sigset_t* set;
 };
 
-// Structure to pass required info to a client thread
+// Structure to pass required info to a client thread. wakeFd is the
+// eventfd bumped whenever one of the thread's crack requests is answered.
 typedef struct {
     int* connectedFd;
-    Dictionary* dict;
-    sem_t* dataSem;
+    int wakeFd;
     sem_t* clientSem;
     ProgramParams params;
     Statistics* stats;
+    WorkerPool* pool;
+    void* cryptState;
+    char cryptSalt[SALT_SIZE + 1];
+    char cryptResult[MAX_CIPHER_SIZE + 1];
+    void* batchState;
+    char batchSalt[SALT_SIZE + 1];
 } ClientInfo;
 
+// Structure to hold the crack requests of a binary frame, answered together
+// once every valid one has been. remaining is protected by the pool's
+// schedLock.
+typedef struct {
+    int count;
+    int numValid;
+    int remaining;
+    CrackWaiter* waiters;
+    char (*cipherTexts)[MAX_CIPHER_SIZE + 1];
+    bool* valid;
+    void* owner;
+} BinaryCracks;
+
+// Structure to hold a tagged request ("@tag command") whose crack is still
+// being worked on. The request keeps its own copy of the line so the
+// ciphertext outlives the client's line buffer. owner is the Connection
+// or ClientStream the tagged response goes to, which keeps its requests
+// that have not been answered on a list so they can be cancelled.
+typedef struct TaggedRequest {
+    CrackWaiter waiter;
+    char tag[MAX_TAG_SIZE + 1];
+    char line[BUFFER_SIZE];
+    void* owner;
+    struct TaggedRequest* next;
+    struct TaggedRequest* pendingPrev;
+    struct TaggedRequest* pendingNext;
+} TaggedRequest;
+
+// Structure to hold the stream a client thread writes its responses to.
+// Tagged crack requests are answered by a responder thread, started with
+// the first one, so writeLock serialises writes to the stream. Answered
+// requests are queued on answered (protected by answeredLock, which also
+// protects tagsPending, pending and finished) with answeredCount posted for
+// each.
+typedef struct {
+    FILE* to;
+    Statistics* stats;
+    sem_t writeLock;
+    sem_t answeredLock;
+    sem_t answeredCount;
+    TaggedRequest* answered;
+    TaggedRequest* pending;
+    int tagsPending;
+    bool finished;
+    bool started;
+    pthread_t tid;
+} ClientStream;
+
+// Structure to hold a client connection served by an I/O thread. Lines are
+// read into readBuffer and answered one at a time, in order, through
+// writeBuffer. While a crack request is pending no further lines are
+// answered, though tagged requests (tagsPending of them still being
+// cracked) never hold up the lines after them. Once switched to the binary
+// protocol, frames are answered instead of lines. If the client closes its
+// connection (hungUp or readClosed) or the connection fails while any
+// crack request is pending, they are all cancelled (once, setting
+// cancelled), tags listing the tagged ones. A client that only shuts down
+// its sending side looks the same, so half-closed connections are not
+// supported. Only the
+// owning I/O thread touches a connection, apart from the crack worker that
+// hands its answered waiter back. With io_uring the kernel may still be
+// reading retiredBuffer (the write buffer before it last grew) until the
+// send in flight completes, and opsPending counts the ring operations that
+// still refer to the connection.
+typedef struct Connection {
+    int fd;
+    struct IoThread* io;
+    ClientInfo info;
+    char* readBuffer;
+    int readLength;
+    int readCapacity;
+    char* writeBuffer;
+    char* retiredBuffer;
+    int writeLength;
+    int writeOffset;
+    int writeCapacity;
+    char recvBuffer[IO_RING_BUFFER_SIZE];
+    int opsPending;
+    bool recvArmed;
+    bool sendArmed;
+    bool cancelPending;
+    bool shutDown;
+    char line[BUFFER_SIZE];
+    CrackWaiter waiter;
+    bool crackPending;
+    int tagsPending;
+    TaggedRequest* tags;
+    bool hungUp;
+    bool cancelled;
+    bool binary;
+    BinaryCracks* binaryCracks;
+    bool readClosed;
+    bool failed;
+    bool closed;
+    bool watched;
+    uint32_t events;
+    struct Connection* next;
+} Connection;
+
+// Structure to hold one I/O thread: its epoll instance (or io_uring ring),
+// the eventfd used to wake it and the queues (protected by queueLock) of new
+// connections, of connections whose crack request has been answered and of
+// answered tagged requests.
+typedef struct IoThread {
+    struct IoRing* ring;
+    int epollFd;
+    int wakeFd;
+    sem_t queueLock;
+    Connection* incoming;
+    Connection* completed;
+    TaggedRequest* answered;
+    Connection* dead;
+    pthread_t tid;
+} IoThread;
+
+#ifdef HAVE_IO_URING
+// Structure to hold an io_uring instance set up with raw system calls: the
+// mapped submission and completion rings, the listening socket it accepts
+// from and, where the kernel supports multishot recv, a ring of provided
+// buffers that received data lands in. sqLocalTail runs ahead of the
+// shared tail by the entries not yet handed to the kernel.
+typedef struct IoRing {
+    int fd;
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned sqMask;
+    unsigned* sqArray;
+    unsigned sqEntries;
+    unsigned sqLocalTail;
+    struct io_uring_sqe* sqes;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe* cqes;
+    bool multishotAccept;
+    bool multishotRecv;
+    struct io_uring_buf_ring* bufRing;
+    unsigned short bufTail;
+    char* buffers;
+    int listenFd;
+    ClientInfo clientInfo;
+    bool acceptArmed;
+    uint64_t wakeValue;
+} IoRing;
+
+// Kinds of ring operation, kept in the low bits of each operation's
+// user_data alongside the connection it is for
+typedef enum {
+    RING_RECV = 0,
+    RING_SEND = 1,
+    RING_CANCEL = 2,
+    RING_ACCEPT = 3,
+    RING_WAKE = 4,
+} RingOp;
+#define RING_OP_MASK 7
+#endif
+
 // Enumerated type with various exit status'
 typedef enum {
     USAGE_ERROR = 1,
@@ -85,58 +819,324 @@ typedef enum {
     DICT_TEXT_ERROR = 3,
     SOCKET_OPEN_ERROR = 4,
     NUMBER_ERROR = 5,
+    BENCHMARK_ERROR = 6,
+    SNAPSHOT_ERROR = 7,
+    RULES_ERROR = 8,
+    POTFILE_ERROR = 9,
+    TABLES_ERROR = 10,
 } ExitStatus;
 
+// Tables derived from the DES tables by init_des_tables(), shared by every
+// crypt backend and never changed afterwards.
+DesTables desTables;
+
+// The generation of the last dictionary loaded
+long dictionaryGenerations = 0;
+
 /* Function prototypes - see decriptions with the functions themselves */
 void usage_error(void);
 void dictionary_open_error(char* fileName);
 void dictionary_text_error(void);
+void snapshot_write_error(char* fileName);
+void snapshot_corrupt_error(char* fileName);
+void rules_file_error(char* fileName, int line);
+void potfile_error(char* fileName);
+void tables_error(char* fileName);
 void socket_open_error(void);
 ProgramParams process_command_line(int argc, char* argv[]);
+void add_dictionary_option(ProgramParams* params, char* arg);
+bool valid_option_name(char* name);
+void add_rules_option(ProgramParams* params, char* arg);
+RuleSet* load_rule_sets(ProgramParams params);
+bool parse_rule(char* line, Rule* rule);
+RuleSet* find_rule_set(WorkerPool* pool, char* name);
+bool is_mask(char* text);
+bool parse_mask(char* text, Mask* mask);
+void add_mask_part(Mask* mask, MaskPart* part);
 Dictionary parse_dictionary(char* fileName);
+ExitStatus load_dictionary(char* fileName, Dictionary* dict,
+	WordHits* hits);
+void add_learned_weights(WordHits* hits, Dictionary* dict, long* weights);
+void order_dictionary(Dictionary* dict, long* weights);
+int compare_word_weights(const void* a, const void* b, void* weights);
+int word_hit_slot(WordHits* hits, uint64_t word);
+void record_word_hit(WordHits* hits, uint64_t word);
+char* map_dictionary_file(int fd, size_t* size, bool* mapped);
+uint64_t pack_word(const char* word, int length);
+void unpack_word(uint64_t slot, char* word);
+uint64_t word_key_hash(uint64_t key);
+void run_dictionary_loaders(DictionaryLoad* load, void* (*phase)(void*));
+long line_weight(const char* line, const char** lineEnd);
+void* scan_dictionary_chunk(void* ptr);
+void mark_partition_key(PartitionKey* key, uint64_t* slots,
+	unsigned int mask, bool* seenEmpty, bool* repeated);
+void* mark_repeated_words(void* ptr);
+void* count_dictionary_chunk(void* ptr);
+void* fill_dictionary_chunk(void* ptr);
+uint64_t snapshot_checksum(const void* data, size_t length, uint64_t hash);
+bool load_dictionary_snapshot(char* data, size_t size, Dictionary* dict);
+void write_dictionary_snapshot(Dictionary* dict, char* fileName);
+int compare_table_entries(const void* a, const void* b);
+void* build_salt_tables(void* ptr);
+void precompute_crack_tables(Dictionary* dict, const CryptBackend* backend,
+	char* fileName, int numThreads);
+CrackTables* map_crack_tables(char* fileName, Dictionary* dict);
+CrackTables* load_crack_tables(char* fileName, Dictionary* dict);
+bool lookup_crack_tables(ClientInfo* clientInfo, CrackWaiter* waiter,
+	Dictionary* dict);
+void free_dictionary(Dictionary* dict);
+LengthBuckets* length_buckets(Dictionary* dict);
+Dictionary* acquire_dictionary(DictionarySource* source);
+void release_dictionary(Dictionary* dict);
+void start_dictionary_reload(DictionarySource* source);
+void* reload_dictionary(void* ptr);
+DictionarySet* create_dictionary_set(ProgramParams params,
+	Dictionary dictionary);
+DictionarySource* find_dictionary(DictionarySet* set, char* name);
 int is_valid_number(char* number);
 void init_lock(sem_t* l, int value);
 void take_lock(sem_t* l);
 void release_lock(sem_t* l);
-void* crack_cipher(void* ptr);
-char* retrieve_salt(char* cipherText);
+int crack_cipher(CrackTask* task, void* state, WorkerPool* pool);
+int mangle_batch(CrackJob* job, long position, long end, int size,
+	uint64_t* candidates, long* covered);
+uint64_t slot_char_range(uint64_t slot, int low, int high);
+int slot_length(uint64_t slot);
+uint64_t apply_rule(const Rule* rule, uint64_t slot);
+int mask_batch(const Mask* mask, long index, int count,
+	uint64_t* candidates);
+int combine_batch(const LengthBuckets* buckets, long index, int count,
+	uint64_t* candidates);
+void retrieve_salt(char* cipherText, char* salt);
+int core_count(void);
+WorkerPool* create_worker_pool(int numWorkers, Statistics* stats,
+	DictionarySet* dictionaries, RuleSet* ruleSets, int numRuleSets,
+	const CryptBackend* backend, Potfile* potfile);
+int salt_index(char* salt);
+unsigned int cipher_hash(uint64_t result);
+CipherSet* build_cipher_set(CrackWaiter* waiters);
+void release_cipher_set(CipherSet* set);
+bool cipher_set_contains(CipherSet* set, uint64_t result);
+void rebuild_cipher_set(CrackJob* job);
+CrackCache* create_crack_cache(void);
+uint64_t crack_scope(Dictionary* dict, RuleSet* rules, Mask* mask,
+	bool combine);
+CacheShard* cache_shard(CrackCache* cache, const char* cipherText,
+	int* bucket);
+int find_cache_entry(CacheShard* shard, int bucket, const char* cipherText);
+void unlink_cache_entry(CacheShard* shard, int index);
+void push_cache_entry(CacheShard* shard, int index);
+bool lookup_crack_cache(WorkerPool* pool, CrackWaiter* waiter,
+	uint64_t scope);
+void store_crack_cache(WorkerPool* pool, CrackWaiter* waiter,
+	uint64_t scope);
+bool potfile_key(const char* cipherText, uint32_t* salt, uint64_t* result);
+PotEntry* find_pot_entry(Potfile* pot, uint32_t salt, uint64_t result);
+void grow_pot_index(Potfile* pot);
+bool add_pot_entry(Potfile* pot, uint32_t salt, uint64_t result,
+	uint64_t word);
+size_t index_pot_records(Potfile* pot, const char* data, size_t size,
+	bool endsLine, char* added, size_t* addedSize);
+uint64_t potfile_tail_checksum(int fd, size_t length);
+size_t load_pot_index(Potfile* pot, int fd, size_t size);
+void write_pot_index(Potfile* pot);
+Potfile* open_potfile(char* fileName);
+void import_potfile(Potfile* pot, char* fileName);
+bool lookup_potfile(WorkerPool* pool, CrackWaiter* waiter);
+void record_potfile(Potfile* pot, const char* cipherText, uint64_t word);
+void answer_crack_request(WorkerPool* pool, CrackWaiter* waiter);
+void link_crack_job(WorkerPool* pool, CrackJob* job);
+void unlink_crack_job(WorkerPool* pool, CrackJob* job);
+CrackJob* find_crack_job(WorkerPool* pool, Dictionary* dict,
+	RuleSet* rules, Mask* mask, bool combine, char* salt);
+void retire_crack_job(WorkerPool* pool, CrackJob* job);
+void submit_crack_request(ClientInfo* clientInfo, CrackWaiter* waiter,
+	DictionarySource* source, RuleSet* rules, Mask* mask, bool combine);
+void remove_waiter(WorkerPool* pool, CrackJob* job, CrackWaiter* waiter);
+void wake_crack_waiter(CrackWaiter* waiter);
+void cancel_waiter(WorkerPool* pool, CrackWaiter* waiter);
+void answer_matching_waiters(WorkerPool* pool, CrackJob* job,
+	char* cipherText, uint64_t word);
+bool claim_crack_chunk(WorkerPool* pool, CrackTask* task);
+void finish_crack_chunk(WorkerPool* pool, CrackTask* task);
+void* crack_worker(void* ptr);
 int get_serv_socket(const char* port);
-void process_connections(ProgramParams params, Dictionary dict,
-	Statistics* stats);
+void process_connections(ProgramParams params,
+	DictionarySet* dictionaries, RuleSet* ruleSets, Statistics* stats,
+	const CryptBackend* backend, Potfile* potfile);
 void* handle_client(void* ptr);
 int list_length(char** list);
-char* handle_crack_request(char** args, int length, ClientInfo* clientInfo);
-char* handle_crypt_request(char** args, int length); 
+char* handle_command(char* buffer, ClientInfo* clientInfo,
+	CrackWaiter* waiter);
+char* handle_crack_request(char** args, int length, ClientInfo* clientInfo,
+	CrackWaiter* waiter);
+char* crack_response(CrackWaiter* waiter, Statistics* stats);
+void wait_for_crack(ClientInfo* clientInfo, CrackWaiter* waiter);
+IoThread* create_io_threads(int numThreads);
+void* io_thread(void* ptr);
+void wake_io_thread(IoThread* io);
+void add_connection(IoThread* io, int fd, ClientInfo* clientInfo);
+void watch_connection(Connection* conn);
+void update_connection_events(Connection* conn);
+void read_connection(Connection* conn);
+void flush_connection(Connection* conn);
+void queue_response(Connection* conn, char* response);
+char* reserve_response(Connection* conn, int length);
+int next_frame_length(Connection* conn);
+void answer_connection_frame(Connection* conn, int length);
+void complete_connection_cracks(CrackWaiter* waiter);
+int next_line_length(Connection* conn);
+void service_connection(Connection* conn);
+void cancel_connection_cracks(Connection* conn);
+void complete_connection_crack(CrackWaiter* waiter);
+void close_connection(Connection* conn);
+Connection* create_connection(IoThread* io, int fd, ClientInfo* clientInfo);
+void answer_completed_connections(IoThread* io);
+void free_dead_connections(IoThread* io);
+bool serve_io_ring(int socketFd, ClientInfo* clientInfo);
+#ifdef HAVE_IO_URING
+bool io_ring_supports_ops(int ringFd);
+IoRing* create_io_ring(int listenFd, ClientInfo* clientInfo);
+bool create_ring_buffers(IoRing* ring);
+void return_ring_buffer(IoRing* ring, int bufferId);
+struct io_uring_sqe* io_ring_sqe(IoRing* ring);
+void submit_io_ring(IoRing* ring, bool wait);
+void arm_ring_accept(IoRing* ring);
+void arm_ring_wake(IoThread* io);
+void arm_ring_recv(Connection* conn);
+void arm_ring_send(Connection* conn);
+void ring_accept_done(IoThread* io, int res, unsigned flags);
+void ring_recv_done(Connection* conn, int res, unsigned flags);
+void ring_send_done(Connection* conn, int res);
+void handle_ring_completion(IoThread* io, struct io_uring_cqe* cqe);
+#endif
+char* handle_crypt_request(char** args, int length, ClientInfo* clientInfo);
+char* split_request_tag(char* line, char* tag);
+char* tag_response(char* tag, char* result, char* out);
+TaggedRequest* create_tagged_request(char* tag, char* command, void* owner,
+	void (*complete)(CrackWaiter* waiter));
+void write_client_response(ClientStream* stream, char* tag, char* result);
+char* handle_stream_tagged_request(char* tag, char* command,
+	ClientInfo* clientInfo, ClientStream* stream);
+void complete_stream_crack(CrackWaiter* waiter);
+void* client_responder(void* ptr);
+void finish_client_stream(ClientStream* stream, WorkerPool* pool);
+void link_tagged_request(TaggedRequest** list, TaggedRequest* request);
+void unlink_tagged_request(TaggedRequest** list, TaggedRequest* request);
+void cancel_tagged_requests(WorkerPool* pool, TaggedRequest* list);
+char* handle_connection_tagged_request(Connection* conn, char* tag,
+	char* command);
+void complete_connection_tag(CrackWaiter* waiter);
+void* client_crypt_state(ClientInfo* clientInfo,
+	const CryptBackend* backend, char* salt);
+void put_binary_value(unsigned char* out, uint32_t value, int size);
+uint32_t get_binary_value(unsigned char* in, int size);
+void put_binary_header(unsigned char* out, BinaryFrameType type, int count,
+	int recordSize);
+int binary_frame_length(unsigned char* data, int available);
+int binary_response_length(unsigned char* frame);
+void answer_binary_crypts(unsigned char* frame, ClientInfo* clientInfo,
+	unsigned char* out);
+BinaryCracks* submit_binary_cracks(unsigned char* frame,
+	ClientInfo* clientInfo, void (*complete)(CrackWaiter* waiter),
+	void* owner);
+void answer_binary_cracks(BinaryCracks* cracks, Statistics* stats,
+	unsigned char* out);
+void serve_binary_client(FILE* from, ClientStream* stream,
+	ClientInfo* clientInfo);
+void write_client_frame(ClientStream* stream, unsigned char* frame,
+	int length);
 int valid_chars(char* word);
 bool valid_args(char** args, int length, int jobType);
 void* stats_on_sighup(void* ptr);
-void update_client_count(sem_t* dataSem, int operation, Statistics* stats);
-void update_completed_clients(sem_t* dataSem, Statistics* stats);
-void update_crack_requests(sem_t* dataSem, int stream, Statistics* stats);
-void update_crypt_requests(sem_t* dataSem, Statistics* stats);
-void update_crypt_calls(sem_t* dataSem, Statistics* stats);
+void print_dictionary_statistics(DictionarySource* source);
+StatsShard* stats_shard(Statistics* stats);
+void add_statistic(long* counter, long amount);
+void sum_statistics(Statistics* stats, StatsShard* total);
+void update_client_count(int operation, Statistics* stats);
+void update_completed_clients(Statistics* stats);
+void update_crack_requests(int stream, Statistics* stats);
+void update_crypt_requests(Statistics* stats, long count);
+void update_crypt_calls(Statistics* stats, long count);
+void init_des_tables(DesTables* tables);
+int crypt_char_value(char c);
+void salt_expansion(const char* salt, int* expansion);
+void encode_crypt_result(const char* salt, uint64_t result, char* out);
+bool decode_crypt_result(const char* cipherText, uint64_t* result);
+void* libcrypt_create(const CryptBackend* backend);
+void libcrypt_init_salt(void* state, const char* salt);
+void libcrypt_hash_batch(void* state, const uint64_t* words, int count,
+	uint64_t* results);
+void* scalar_des_create(const CryptBackend* backend);
+void scalar_des_init_salt(void* state, const char* salt);
+void scalar_des_hash_batch(void* state, const uint64_t* words, int count,
+	uint64_t* results);
+void* bitslice_create(const CryptBackend* backend);
+void bitslice_init_salt(void* state, const char* salt);
+void bitslice_hash_batch(void* state, const uint64_t* words, int count,
+	uint64_t* results);
+bool crypt_backend_supported(const CryptBackend* backend);
+bool verify_crypt_backend(const CryptBackend* backend);
+const CryptBackend* select_crypt_backend(const char* name);
+double seconds_since(struct timespec* start);
+void run_benchmark(Dictionary dict);
 
 /*****************************************************************************/
 int main(int argc, char* argv[]) {
     
-    Statistics* stats = malloc(sizeof(Statistics));
+    // Shards must start on a cache line of their own
+    Statistics* stats;
+    if (posix_memalign((void**)&stats, STATS_LINE_SIZE, sizeof(Statistics))) {
+	return 1;
+    }
     memset(stats, 0, sizeof(Statistics));
     Dictionary dictionary;
     // Get program parameters
     ProgramParams params = process_command_line(argc, argv);
-    // Establish dictionary
-    if (params.fileName != 0) {
-	dictionary = parse_dictionary(params.fileName);
-    } else {
-	dictionary = parse_dictionary("/usr/share/dict/words");
+    // Pick the crypt backend, an unknown name is a usage error
+    init_des_tables(&desTables);
+    const CryptBackend* backend = select_crypt_backend(params.backend);
+    if (backend == NULL) {
+	usage_error();
+    }
+    // Open the potfile, or import records into it and exit
+    Potfile* potfile = NULL;
+    if (params.potfileName) {
+	potfile = open_potfile(params.potfileName);
     }
-    // Tell all threads to ignore SIGHUP signal,
-    // Create a thread specifically to handle the signal.
+    if (params.importName) {
+	import_potfile(potfile, params.importName);
+	return 0;
+    }
+    // Establish the default dictionary
+    dictionary = parse_dictionary(params.dictionaries[0].fileName);
+    if (params.snapshotName) {
+	write_dictionary_snapshot(&dictionary, params.snapshotName);
+	return 0;
+    }
+    if (params.benchmark) {
+	run_benchmark(dictionary);
+    }
+    if (params.precomputeName) {
+	precompute_crack_tables(&dictionary, backend, params.precomputeName,
+		params.workers != 0 && params.workers < core_count()
+		? params.workers : core_count());
+	return 0;
+    }
+    if (params.tablesName) {
+	dictionary.tables = load_crack_tables(params.tablesName, &dictionary);
+    }
+    // Clients are served from copies that SIGUSR1 can replace
+    DictionarySet* dictionaries = create_dictionary_set(params, dictionary);
+    RuleSet* ruleSets = load_rule_sets(params);
+    // Tell all threads to ignore SIGHUP and SIGUSR1 signals,
+    // Create a thread specifically to handle the signals.
     pthread_t sigthread;
     sigset_t set;
     int s;
     sigemptyset(&set);
     sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGUSR1);
     s = pthread_sigmask(SIG_BLOCK, &set, NULL);
     if (s != 0) {
 	fprintf(stderr, "Error initialising masking\n");
@@ -144,43 +1144,98 @@ int main(int argc, char* argv[]) {
     struct SigInfo sigInfo;
     memset(&sigInfo, 0, sizeof(struct SigInfo));
     sigInfo.stats = stats, sigInfo.set = &set;
+    sigInfo.dictionaries = dictionaries;
     s = pthread_create(&sigthread, NULL, &stats_on_sighup, (void*)&sigInfo);
     // Process requests from clients
-    process_connections(params, dictionary, stats);
+    process_connections(params, dictionaries, ruleSets, stats, backend,
+	    potfile);
     return 0;
 }
 
 // Thread function dedicated to handling printing of statistics. 
 // Takes in a void* variable which should be cast to a SigInfo struct.
 // Uses the information within the structure to allow waiting for a particular
-// signal and print statistics
+// signal and print statistics, summed over every shard. SIGUSR1 instead
+// starts reloading the dictionary.
 void* stats_on_sighup(void* ptr) {
     
     struct SigInfo* s = (struct SigInfo*)ptr;
     sigset_t* set = s->set;
     Statistics* stats = s->stats;
+    DictionarySet* dictionaries = s->dictionaries;
+    StatsShard total;
+    struct timespec lastReport;
+    long lastCalls = 0;
     int sig;
+    clock_gettime(CLOCK_MONOTONIC, &lastReport);
     while (1) {
 	sigwait(set, &sig);
-	fprintf(stderr, "Connected clients: %i\n", stats->connectedClients);
-	fprintf(stderr, "Completed clients: %i\n", stats->completedClients);
-	fprintf(stderr, "Crack requests: %i\n", stats->crackRequests);
-	fprintf(stderr, "Failed crack requests: %i\n",stats->failedRequests);
-	fprintf(stderr, "Successful crack requests: %i\n", 
-		stats->successfulRequests);
-	fprintf(stderr, "Crypt requests: %i\n", stats->cryptRequests);
-	fprintf(stderr, "crypt()/crypt_r() calls: %i\n", stats->cryptCalls);
+	if (sig == SIGUSR1) {
+	    for (int i = 0; i < dictionaries->numSources; i++) {
+		start_dictionary_reload(dictionaries->sources[i]);
+	    }
+	    continue;
+	}
+	sum_statistics(stats, &total);
+	fprintf(stderr, "Connected clients: %li\n", total.connectedClients);
+	fprintf(stderr, "Completed clients: %li\n", total.completedClients);
+	fprintf(stderr, "Crack requests: %li\n", total.crackRequests);
+	fprintf(stderr, "Failed crack requests: %li\n",total.failedRequests);
+	fprintf(stderr, "Successful crack requests: %li\n", 
+		total.successfulRequests);
+	fprintf(stderr, "Crypt requests: %li\n", total.cryptRequests);
+	fprintf(stderr, "crypt()/crypt_r() calls: %li\n", total.cryptCalls);
+	fprintf(stderr, "Crack cache hits: %li\n", total.cacheHits);
+	fprintf(stderr, "Crack cache misses: %li\n", total.cacheMisses);
+	fprintf(stderr, "Crack cache evictions: %li\n",
+		total.cacheEvictions);
+	// Throughput since the last report (or since the server started)
+	fprintf(stderr, "Crypts per second: %.0f\n",
+		(total.cryptCalls - lastCalls) / seconds_since(&lastReport));
+	lastCalls = total.cryptCalls;
+	clock_gettime(CLOCK_MONOTONIC, &lastReport);
+	for (int i = 0; i < dictionaries->numSources; i++) {
+	    print_dictionary_statistics(dictionaries->sources[i]);
+	}
 	fflush(stderr);
     }
     return (void*)0;
 }
 
+// Function that prints the statistics of the given dictionary, naming it if
+// it has a name.
+void print_dictionary_statistics(DictionarySource* source) {
+
+    char label[MAX_NAME_LABEL];
+    label[0] = '\0';
+    if (source->name) {
+	snprintf(label, MAX_NAME_LABEL, " \"%s\"", source->name);
+    }
+    take_lock(&source->lock);
+    fprintf(stderr, "Dictionary%s words: %i\n", label,
+	    source->current->numWords);
+    fprintf(stderr, "Dictionary%s reloads: %li\n", label, source->reloads);
+    fprintf(stderr, "Failed dictionary%s reloads: %li\n", label,
+	    source->failedReloads);
+    if (source->reloads > 0) {
+	fprintf(stderr, "Last dictionary%s reload: %.3f seconds, %i words "
+		"replaced by %i\n", label, source->reloadSeconds,
+		source->previousWords, source->current->numWords);
+    }
+    release_lock(&source->lock);
+}
+
 // Function that prints the usage error message and exits with a non zero exit
 // status, does not take any input. 
 void usage_error() {
     
     fprintf(stderr, "Usage: crackserver [--maxconn connections]"
-	    " [--port portnum] [--dictionary filename]\n");
+	    " [--port portnum] [--dictionary [name=]filename ...]"
+	    " [--rules name=filename ...]"
+	    " [--workers count] [--backend name] [--io threads|epoll|uring]"
+	    " [--benchmark] [--compile-dictionary snapshot]"
+	    " [--potfile filename [--import-potfile filename]]"
+	    " [--precompute tables] [--tables tables]\n");
     exit(USAGE_ERROR);
 }
 
@@ -193,6 +1248,56 @@ void dictionary_open_error(char* fileName) {
     exit(DICT_OPEN_ERROR);
 }
 
+// Function that prints the snapshot write error message and refers to the
+// relevant filename. Exits with a non zero exit status.
+void snapshot_write_error(char* fileName) {
+
+    fprintf(stderr, "crackserver: unable to write dictionary snapshot "
+	    "\"%s\"\n", fileName);
+    exit(SNAPSHOT_ERROR);
+}
+
+// Function that prints the snapshot corrupt error message and refers to the
+// relevant filename. Exits with a non zero exit status.
+void snapshot_corrupt_error(char* fileName) {
+
+    fprintf(stderr, "crackserver: dictionary snapshot \"%s\" is corrupt\n",
+	    fileName);
+    exit(SNAPSHOT_ERROR);
+}
+
+// Function that prints the rules file error message and refers to the
+// relevant filename and, if it is not 0, the line with an invalid rule.
+// Exits with a non zero exit status.
+void rules_file_error(char* fileName, int line) {
+
+    if (line == 0) {
+	fprintf(stderr, "crackserver: unable to load rules file \"%s\"\n",
+		fileName);
+    } else {
+	fprintf(stderr, "crackserver: invalid rule on line %i of rules file "
+		"\"%s\"\n", line, fileName);
+    }
+    exit(RULES_ERROR);
+}
+
+// Function that prints the potfile error message and refers to the
+// relevant filename. Exits with a non zero exit status.
+void potfile_error(char* fileName) {
+
+    fprintf(stderr, "crackserver: unable to use potfile \"%s\"\n",
+	    fileName);
+    exit(POTFILE_ERROR);
+}
+
+// Function that prints the tables error message and refers to the
+// relevant filename. Exits with a non zero exit status.
+void tables_error(char* fileName) {
+
+    fprintf(stderr, "crackserver: unable to use tables \"%s\"\n", fileName);
+    exit(TABLES_ERROR);
+}
+
 // Function that prints the dictionary text error message if no words are
 // present in a dictionary, no input required, exits with a non-zero 
 // exit status.
@@ -271,21 +1376,48 @@ void release_lock(sem_t* l) {
 
 // Function that processes the connection from incoming clients
 // Takes in a ProgramParams structure argument to set certain conditions for
-// the client and a dictionary which is used for crypting and cracking.
-void process_connections(ProgramParams params, Dictionary dict,
-	Statistics* stats) {
+// the client, the dictionaries and rule sets used for cracking, the crypt
+// backend that does the hashing and the potfile (NULL for none). Each
+// client gets a thread of its own, or in epoll mode is handed to one of a
+// few I/O threads in turn. In io_uring mode this thread serves every
+// client itself (falling back to epoll mode if the kernel lacks io_uring).
+void process_connections(ProgramParams params,
+	DictionarySet* dictionaries, RuleSet* ruleSets, Statistics* stats,
+	const CryptBackend* backend, Potfile* potfile) {
     
     int connectedFd;
     int socketFd = get_serv_socket(params.port);
     struct sockaddr_in fromAddr;
     socklen_t fromAddrSize;
     sem_t clientSem;
-    sem_t dataSem;
-    init_lock(&dataSem, 1);
+    // Start the crack workers before any client can submit work, all
+    // clients share them so never run more than there are cores
+    int numWorkers = core_count();
+    if (params.workers != 0 && params.workers < numWorkers) {
+	numWorkers = params.workers;
+    }
+    WorkerPool* pool = create_worker_pool(numWorkers, stats, dictionaries,
+	    ruleSets, params.numRuleSets, backend, potfile);
+    int numIoThreads = core_count() < MAX_IO_THREADS ? core_count()
+	    : MAX_IO_THREADS;
+    IoThread* ioThreads = NULL;
+    int nextIoThread = 0;
     // limit client connetions;
     if (params.connections != 0) {
 	init_lock(&clientSem, params.connections);	
     }
+    if (params.ioModel == IO_URING) {
+	ClientInfo ringInfo;
+	memset(&ringInfo, 0, sizeof(ClientInfo));
+	ringInfo.params = params, ringInfo.clientSem = &clientSem;
+	ringInfo.stats = stats;
+	ringInfo.pool = pool;
+	serve_io_ring(socketFd, &ringInfo);
+	fprintf(stderr, "crackserver: io_uring unavailable, using epoll\n");
+    }
+    if (params.ioModel != IO_THREADS) {
+	ioThreads = create_io_threads(numIoThreads);
+    }
     while (1) {
 
 	fromAddrSize = sizeof(struct sockaddr_in);
@@ -297,397 +1429,5290 @@ void process_connections(ProgramParams params, Dictionary dict,
 	if (connectedFd < 0) {
 	    socket_open_error();
 	}	    
-	update_client_count(&dataSem, 0, stats);
-	int* connectedPtr = malloc(sizeof(int));
-	*connectedPtr = connectedFd;
-	pthread_t threadId;
+	update_client_count(0, stats);
 	ClientInfo* clientInfo = malloc(sizeof(ClientInfo));
 	memset(clientInfo, 0, sizeof(ClientInfo));
-	clientInfo->connectedFd = connectedPtr, clientInfo->dict = &dict; 
 	clientInfo->params = params, clientInfo->clientSem = &clientSem;
-	clientInfo->dataSem = &dataSem, clientInfo->stats = stats;
+	clientInfo->stats = stats;
+	clientInfo->pool = pool;
+	if (ioThreads) {
+	    add_connection(&ioThreads[nextIoThread], connectedFd, clientInfo);
+	    nextIoThread = (nextIoThread + 1) % numIoThreads;
+	    continue;
+	}
+	int* connectedPtr = malloc(sizeof(int));
+	*connectedPtr = connectedFd;
+	pthread_t threadId;
+	clientInfo->connectedFd = connectedPtr;
 	pthread_create(&threadId, 0, handle_client, clientInfo);
 	pthread_detach(threadId);
     }
-    sem_destroy(&dataSem);
     sem_destroy(&clientSem);
 }
 
 // A threading function to establish connection with a client and handle 
 // the clients requests. Takes in void* ptr as an argument which will be a
-// structure containing required information. Returns NULL.
+// structure containing required information. Untagged requests are
+// answered in order, tagged crack requests are answered by the client's
+// responder thread as they finish. Returns NULL.
 void* handle_client(void* ptr) { 
     // Client info containsconnectedPtr, stats pointer, dictionary pointer
     ClientInfo* clientInfo = (ClientInfo*)ptr;
     // Establish communication with client
     int fd2 = *(clientInfo->connectedFd);
-    sem_t* dataSem = clientInfo->dataSem;
-    Statistics* stats = clientInfo->stats;
     int fd = dup(fd2);
+    clientInfo->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
     FILE* to = fdopen(fd, "w");
     FILE* from = fdopen(fd2, "r");
-    char** args;
     char* result = "";
-    size_t length;
     char buffer[BUFFER_SIZE];
+    char tag[MAX_TAG_SIZE + 1];
+    CrackWaiter waiter;
+    memset(&waiter, 0, sizeof(CrackWaiter));
+    ClientStream stream;
+    memset(&stream, 0, sizeof(ClientStream));
+    stream.to = to;
+    stream.stats = clientInfo->stats;
+    init_lock(&stream.writeLock, 1);
+    init_lock(&stream.answeredLock, 1);
+    init_lock(&stream.answeredCount, 0);
     while (fgets(buffer, BUFFER_SIZE, from) != NULL) {
 	// Lets say its a standard command of crack "q904idDRadd" 5
-	args = split_by_char(buffer, ' ', 0);
-	length = list_length(args);
-	if (length <= 1 || length > 3) {
-	    fprintf(to, ":invalid\n");
-	    fflush(to);
-	    continue;
+	if (strcmp(buffer, BIN_HANDSHAKE) == 0) {
+	    write_client_response(&stream, "", "binary");
+	    serve_binary_client(from, &stream, clientInfo);
+	    break;
 	}
-	if (strcmp(args[0], "crack") == 0) {
-	    result = handle_crack_request(args, length, clientInfo);
-	} else if (strcmp(args[0], "crypt") == 0) {
-	    update_crypt_requests(dataSem, stats);
-	    update_crypt_calls(dataSem, stats);
-	    result = handle_crypt_request(args, length);
-	    
-	} else {
-	    fprintf(to, ":invalid\n");
-	    fflush(to);
-	    continue;
+	char* command = split_request_tag(buffer, tag);
+	if (command == NULL) {
+	    result = ":invalid";
+	} else if (tag[0] != '\0') {
+	    result = handle_stream_tagged_request(tag, command, clientInfo,
+		    &stream);
+	    if (result == NULL) {
+		continue;
+	    }
+	} else if ((result = handle_command(command, clientInfo, &waiter))
+		== NULL) {
+	    // Cancelled crack request, the client has hung up
+	    break;
 	}
-	fprintf(to, result);
-	fprintf(to, "\n");
-	fflush(to);
+	write_client_response(&stream, tag, result);
     }
-    update_client_count(dataSem, 1, clientInfo->stats);
-    update_completed_clients(dataSem, clientInfo->stats);
+    finish_client_stream(&stream, clientInfo->pool);
+    // Workers bump the eventfd with schedLock held, so once it is free
+    // none can still be about to
+    take_lock(&clientInfo->pool->schedLock);
+    release_lock(&clientInfo->pool->schedLock);
+    close(clientInfo->wakeFd);
+    update_client_count(1, clientInfo->stats);
+    update_completed_clients(clientInfo->stats);
     if (clientInfo->params.connections != 0) {
 	release_lock(clientInfo->clientSem);
     }
     fclose(to);
     fclose(from);
+    free(clientInfo->cryptState);
+    free(clientInfo->batchState);
+    return NULL;
+}
+
+// Function that splits the tag off a request line. A tagged line is
+// TAG_MARKER followed by a tag of 1 to MAX_TAG_SIZE characters, a space and
+// the command ('#' would start a comment in a job file). Copies the tag
+// (without the marker) into tag, which is left empty for an untagged line.
+// Returns the command, or NULL if the line's tag is invalid.
+char* split_request_tag(char* line, char* tag) {
+
+    tag[0] = '\0';
+    if (line[0] != TAG_MARKER) {
+	return line;
+    }
+    char* space = strchr(line, ' ');
+    if (space == NULL || space - line - 1 < 1
+	    || space - line - 1 > MAX_TAG_SIZE) {
+	return NULL;
+    }
+    memcpy(tag, line + 1, space - line - 1);
+    tag[space - line - 1] = '\0';
+    return space + 1;
+}
+
+// Function that formats a response line (without its newline) for a
+// request with the given tag. Takes in the tag (empty for an untagged
+// request), the response and a buffer of at least MAX_TAG_SIZE +
+// BUFFER_SIZE + 3 characters. Returns the line, which is the response
+// itself if untagged.
+char* tag_response(char* tag, char* result, char* out) {
+
+    if (tag[0] == '\0') {
+	return result;
+    }
+    snprintf(out, MAX_TAG_SIZE + BUFFER_SIZE + 3, "%c%s %s", TAG_MARKER,
+	    tag, result);
+    return out;
+}
+
+// Function that creates a tagged request with the given tag and command,
+// answered through the given complete function. owner is where its
+// response goes. Returns the new request.
+TaggedRequest* create_tagged_request(char* tag, char* command, void* owner,
+	void (*complete)(CrackWaiter* waiter)) {
+
+    TaggedRequest* request = calloc(1, sizeof(TaggedRequest));
+    strcpy(request->tag, tag);
+    strncpy(request->line, command, BUFFER_SIZE - 1);
+    request->owner = owner;
+    request->waiter.complete = complete;
+    request->waiter.owner = request;
+    return request;
+}
+
+// Function that adds a tagged request to the front of a list of requests
+// that have not been answered.
+void link_tagged_request(TaggedRequest** list, TaggedRequest* request) {
+
+    request->pendingPrev = NULL;
+    request->pendingNext = *list;
+    if (*list) {
+	(*list)->pendingPrev = request;
+    }
+    *list = request;
+}
+
+// Function that removes an answered tagged request from its list.
+void unlink_tagged_request(TaggedRequest** list, TaggedRequest* request) {
+
+    if (request->pendingPrev) {
+	request->pendingPrev->pendingNext = request->pendingNext;
+    } else {
+	*list = request->pendingNext;
+    }
+    if (request->pendingNext) {
+	request->pendingNext->pendingPrev = request->pendingPrev;
+    }
+}
+
+// Function that cancels every crack request on a list of tagged requests
+// that has not been answered yet. Must be called with the pool's schedLock
+// held, and the list must only be changed by the calling thread.
+void cancel_tagged_requests(WorkerPool* pool, TaggedRequest* list) {
+
+    for (; list; list = list->pendingNext) {
+	cancel_waiter(pool, &list->waiter);
+    }
+}
+
+// Function that writes a response line for the request with the given tag
+// (empty if untagged) to a client thread's stream. It is sent like a
+// binary frame, so a client that has gone fails the write rather than
+// raising SIGPIPE.
+void write_client_response(ClientStream* stream, char* tag, char* result) {
+
+    char line[MAX_TAG_SIZE + BUFFER_SIZE + 3];
+    char* response = tag_response(tag, result, line);
+    if (response != line) {
+	snprintf(line, sizeof(line), "%s", response);
+    }
+    int length = strlen(line);
+    line[length++] = '\n';
+    write_client_frame(stream, (unsigned char*)line, length);
+}
+
+// Function that answers a tagged request for a client thread. Takes in the
+// tag, the command, the client's ClientInfo and its stream. A crack
+// request is left to the client's responder thread (started the first
+// time) and NULL returned, anything else is answered straight away.
+// Returns the response.
+char* handle_stream_tagged_request(char* tag, char* command,
+	ClientInfo* clientInfo, ClientStream* stream) {
+
+    if (!stream->started) {
+	pthread_create(&stream->tid, NULL, client_responder, stream);
+	stream->started = true;
+    }
+    TaggedRequest* request = create_tagged_request(tag, command, stream,
+	    complete_stream_crack);
+    take_lock(&stream->answeredLock);
+    stream->tagsPending++;
+    link_tagged_request(&stream->pending, request);
+    release_lock(&stream->answeredLock);
+    char* result = handle_command(request->line, clientInfo,
+	    &request->waiter);
+    if (result == NULL) {
+	return NULL;
+    }
+    take_lock(&stream->answeredLock);
+    stream->tagsPending--;
+    unlink_tagged_request(&stream->pending, request);
+    release_lock(&stream->answeredLock);
+    free(request);
+    return result;
+}
+
+// Function called by a crack worker (with the pool's schedLock held) once
+// a client thread's tagged crack request has been answered. Queues it for
+// the client's responder thread.
+void complete_stream_crack(CrackWaiter* waiter) {
+
+    TaggedRequest* request = (TaggedRequest*)waiter->owner;
+    ClientStream* stream = (ClientStream*)request->owner;
+    take_lock(&stream->answeredLock);
+    request->next = stream->answered;
+    stream->answered = request;
+    release_lock(&stream->answeredLock);
+    release_lock(&stream->answeredCount);
+}
+
+// Thread function run by a client thread's responder. Takes in a void*
+// which is the ClientStream. Writes the response of each tagged crack
+// request as it is answered, until the client has gone and every tagged
+// request has been answered. Returns NULL.
+void* client_responder(void* ptr) {
+
+    ClientStream* stream = (ClientStream*)ptr;
+    bool done = false;
+    while (!done) {
+	take_lock(&stream->answeredCount);
+	take_lock(&stream->answeredLock);
+	TaggedRequest* request = stream->answered;
+	if (request) {
+	    stream->answered = request->next;
+	    unlink_tagged_request(&stream->pending, request);
+	}
+	release_lock(&stream->answeredLock);
+	if (request) {
+	    char* result = crack_response(&request->waiter, stream->stats);
+	    if (result) {
+		write_client_response(stream, request->tag, result);
+	    }
+	    free(request);
+	}
+	take_lock(&stream->answeredLock);
+	if (request) {
+	    stream->tagsPending--;
+	}
+	done = stream->finished && stream->tagsPending == 0;
+	release_lock(&stream->answeredLock);
+    }
     return NULL;
 }
 
+// Function that waits, once a client has gone, for its responder thread
+// (if it was started) to finish. Tagged crack requests still pending are
+// cancelled first, as nobody is left to read their responses (a client
+// that only shut down its sending side counts as gone).
+void finish_client_stream(ClientStream* stream, WorkerPool* pool) {
+
+    if (stream->started) {
+	// The responder frees answered requests, so only those not answered
+	// (which cannot be while schedLock is held) are collected. Lock order
+	// is schedLock then answeredLock, as for answering.
+	take_lock(&pool->schedLock);
+	take_lock(&stream->answeredLock);
+	CrackWaiter** waiters = malloc(sizeof(CrackWaiter*)
+		* (stream->tagsPending + 1));
+	int count = 0;
+	for (TaggedRequest* request = stream->pending; request;
+		request = request->pendingNext) {
+	    if (request->waiter.job) {
+		waiters[count++] = &request->waiter;
+	    }
+	}
+	release_lock(&stream->answeredLock);
+	for (int i = 0; i < count; i++) {
+	    cancel_waiter(pool, waiters[i]);
+	}
+	release_lock(&pool->schedLock);
+	free(waiters);
+	take_lock(&stream->answeredLock);
+	stream->finished = true;
+	release_lock(&stream->answeredLock);
+	// Wakes the responder even if nothing is left to answer
+	release_lock(&stream->answeredCount);
+	pthread_join(stream->tid, NULL);
+    }
+    sem_destroy(&stream->writeLock);
+    sem_destroy(&stream->answeredLock);
+    sem_destroy(&stream->answeredCount);
+}
+
+// Function that answers a single command line from a client. Takes in the
+// line (which is split up in place), the client's ClientInfo and the
+// client's CrackWaiter. Returns the response, without its newline, or NULL
+// if a crack request has been submitted and will be answered through the
+// waiter's complete function (or was cancelled as the client hung up).
+char* handle_command(char* buffer, ClientInfo* clientInfo,
+	CrackWaiter* waiter) {
+
+    char** args = split_by_char(buffer, ' ', 0);
+    int length = list_length(args);
+    char* result = ":invalid";
+    if (length > 1 && length <= 5) {
+	if (strcmp(args[0], "crack") == 0) {
+	    result = handle_crack_request(args, length, clientInfo, waiter);
+	} else if (strcmp(args[0], "crypt") == 0) {
+	    update_crypt_requests(clientInfo->stats, 1);
+	    update_crypt_calls(clientInfo->stats, 1);
+	    result = handle_crypt_request(args, length, clientInfo);
+	}
+    }
+    free(args);
+    return result;
+}
+
 // Function called by handle_client() to handle crypt requests.
 // Takes in a list of string arguments which are used in the crypting 
-// process and the length of that list. Returns the encrypted word 
-// or ":invalid" if certain argument requirements have not been met.
-char* handle_crypt_request(char** args, int length) {
+// process, the length of that list and the client's ClientInfo, which
+// holds the client's crypt backend state. Returns the encrypted word or
+// ":invalid" if certain argument requirements have not been met.
+char* handle_crypt_request(char** args, int length, ClientInfo* clientInfo) {
 
-    struct crypt_data data;
+    const CryptBackend* backend = clientInfo->pool->cryptBackend;
+    char salt[SALT_SIZE + 1];
+    uint64_t result;
     args++;
     length--;
     if (!valid_args(args, length, 0)) {		
 	return ":invalid";
     }
-    char* string = args[0];
-    char* salt = args[1];
-    return crypt_r(string, salt, &data);
+    uint64_t word = pack_word(args[0], strlen(args[0]));
+    retrieve_salt(args[1], salt);
+    backend->hash_batch(client_crypt_state(clientInfo, backend, salt),
+	    &word, 1, &result);
+    encode_crypt_result(salt, result, clientInfo->cryptResult);
+    return clientInfo->cryptResult;
+}
+
+// Function that returns the statistics shard the calling thread updates,
+// handing the thread the next shard in turn the first time it is called.
+// Shards are only shared once there are more than STATS_SHARDS threads.
+StatsShard* stats_shard(Statistics* stats) {
+
+    static __thread int shard = -1;
+    if (shard < 0) {
+	shard = __atomic_fetch_add(&stats->nextShard, 1, __ATOMIC_RELAXED)
+		% STATS_SHARDS;
+    }
+    return &stats->shards[shard];
+}
+
+// Function that adds the given amount to a statistics counter of the
+// calling thread's shard. The shard may be shared so the add is atomic, but
+// the cache line is almost never contended.
+void add_statistic(long* counter, long amount) {
+
+    __atomic_fetch_add(counter, amount, __ATOMIC_RELAXED);
+}
+
+// Function that sums every shard of the statistics into total.
+void sum_statistics(Statistics* stats, StatsShard* total) {
+
+    memset(total, 0, sizeof(StatsShard));
+    for (int i = 0; i < STATS_SHARDS; i++) {
+	StatsShard* shard = &stats->shards[i];
+	total->connectedClients += __atomic_load_n(&shard->connectedClients,
+		__ATOMIC_RELAXED);
+	total->completedClients += __atomic_load_n(&shard->completedClients,
+		__ATOMIC_RELAXED);
+	total->crackRequests += __atomic_load_n(&shard->crackRequests,
+		__ATOMIC_RELAXED);
+	total->failedRequests += __atomic_load_n(&shard->failedRequests,
+		__ATOMIC_RELAXED);
+	total->successfulRequests += __atomic_load_n(
+		&shard->successfulRequests, __ATOMIC_RELAXED);
+	total->cryptRequests += __atomic_load_n(&shard->cryptRequests,
+		__ATOMIC_RELAXED);
+	total->cryptCalls += __atomic_load_n(&shard->cryptCalls,
+		__ATOMIC_RELAXED);
+	total->cacheHits += __atomic_load_n(&shard->cacheHits,
+		__ATOMIC_RELAXED);
+	total->cacheMisses += __atomic_load_n(&shard->cacheMisses,
+		__ATOMIC_RELAXED);
+	total->cacheEvictions += __atomic_load_n(&shard->cacheEvictions,
+		__ATOMIC_RELAXED);
+    }
 }
 
-//Function to update the client count, takes the given sempahore and updates
-//the stats.
-void update_client_count(sem_t* dataSem, int operation, Statistics* stats) {
+//Function to update the client count in the calling thread's shard of the
+//stats. A client may connect and disconnect on different shards, only the
+//sum is meaningful.
+void update_client_count(int operation, Statistics* stats) {
     
     // Operation = 0 means increment, Operation = 1 means decrement;
-    take_lock(dataSem);
+    StatsShard* shard = stats_shard(stats);
     if (operation == 0) {
-	stats->connectedClients += 1;
+	add_statistic(&shard->connectedClients, 1);
     } else {
-	stats->connectedClients -= 1;
+	add_statistic(&shard->connectedClients, -1);
     }
-    release_lock(dataSem);
 }
 
-// Function to update completed clients, takes the given semaphore and
-// updates the stats.
-void update_completed_clients(sem_t* dataSem, Statistics* stats) {
-    take_lock(dataSem); 
-    stats->completedClients += 1;
-    release_lock(dataSem);
+// Function to update completed clients in the calling thread's shard of
+// the stats.
+void update_completed_clients(Statistics* stats) {
+    add_statistic(&stats_shard(stats)->completedClients, 1);
 }
 
-// Function to update the crack requests, takes the given semaphore
-// and depending on the stream will update the stats,
-void update_crack_requests(sem_t* dataSem, int stream, Statistics* stats) {
+// Function to update the crack requests, depending on the stream will
+// update the calling thread's shard of the stats,
+void update_crack_requests(int stream, Statistics* stats) {
 
     // Stream == 0 means update total crack requests
     // Stream == 1 means update failed requests
     // Stream == 2 means update successful requests
-    take_lock(dataSem);
+    StatsShard* shard = stats_shard(stats);
     if (stream == 0) {
-	stats->crackRequests += 1;
+	add_statistic(&shard->crackRequests, 1);
     } else if (stream == 1) {
-	stats->failedRequests += 1;
-    } else {
-	stats->successfulRequests += 1;
+	add_statistic(&shard->failedRequests, 1);
+    } else if (stream == 2) {
+	add_statistic(&shard->successfulRequests, 1);
     }
-    release_lock(dataSem);
 }
 
-// Function to update the crypt requests, takes the given semaphore and
-// updates the stats.
-void update_crypt_requests(sem_t* dataSem, Statistics* stats) {
+// Function to add count crypt requests to the calling thread's shard of
+// the stats.
+void update_crypt_requests(Statistics* stats, long count) {
     
-    take_lock(dataSem);
-    stats->cryptRequests += 1;
-    release_lock(dataSem);
+    add_statistic(&stats_shard(stats)->cryptRequests, count);
 }
 
-// Function to update the crypt calls, takes the given sempahore and updates
-// the stats.
-void update_crypt_calls(sem_t* dataSem, Statistics* stats) {
-    take_lock(dataSem);
-    stats->cryptCalls += 1;
-    release_lock(dataSem);
-}
-
-// Function called by handle_client() to handle cracking requests.
-// The function takes in a list of string arguments which are used in the 
-// cracking process, the length` of that list and a ClientInfo struct pointer. 
-// Returns ":failed" if the cracking process did not find a matching cipher
-// or the word of the matching cipher.
-char* handle_crack_request(char** args, int length, ClientInfo* clientInfo) {
-    volatile int startIndex = 0;
-    volatile bool found = false;
-    volatile int threadsInitiated = 0;
-    sem_t* dataSem = clientInfo->dataSem;
-    char* string;
-    int numThreads = 1;
-    // Skip over crack command
-    args++;
-    length--;
-    update_crack_requests(dataSem, 0, clientInfo->stats);
-    if (!valid_args(args, length, 1)) {
-	return ":invalid";
-    }
-    string = args[0];
-    if (length > 1) {
-	numThreads = atoi(args[1]);
-    }
-    pthread_t tids[numThreads];
-    struct CrackCommInfo info[numThreads];
-    for (int i = 0; i < numThreads; i++) {
-	info[i].startIndex = &startIndex;
-	info[i].dataSem = dataSem;
-	info[i].stats = clientInfo->stats;
-	info[i].dict = clientInfo->dict;
-	info[i].numThreads = numThreads; 
-	info[i].cipherText = string;
-	info[i].found = &found;
-	info[i].threadsInitiated = &threadsInitiated;
-	pthread_create(&(tids[i]), NULL, crack_cipher, info + i);
+// Function that returns the client's state for the given crypt backend
+// (either the pool's crypt backend or its crack backend), created the first
+// time and set up again only when the salt changes.
+void* client_crypt_state(ClientInfo* clientInfo,
+	const CryptBackend* backend, char* salt) {
+
+    bool batch = backend != clientInfo->pool->cryptBackend;
+    void** state = batch ? &clientInfo->batchState : &clientInfo->cryptState;
+    char* stateSalt = batch ? clientInfo->batchSalt : clientInfo->cryptSalt;
+    if (*state == NULL) {
+	*state = backend->create(backend);
     }
-    for (int i = 0; i < numThreads; i++) {
-	void* result;
-	pthread_join(tids[i], &result);
-	if (strcmp((char*)result, "") != 0) {
-	    update_crack_requests(dataSem, 2, clientInfo->stats);
-	    return (char*)result;
-	}
+    if (strcmp(stateSalt, salt) != 0) {
+	backend->init_salt(*state, salt);
+	strcpy(stateSalt, salt);
     }
-    update_crack_requests(dataSem, 1, clientInfo->stats);
-    return ":failed";
+    return *state;
 }
 
-// Function to crack the cipher, takes in a void* ptr which is typically a
-// CrackCommInfo struct pointer which points to information required by
-// each cipher cracking thread. The function returns an empty string "" if
-// no matching cipher was found or it returns the word of the matching cipher.
-void* crack_cipher(void* ptr) {
+// Function that writes a big endian 16 or 32 bit value.
+void put_binary_value(unsigned char* out, uint32_t value, int size) {
 
-    struct CrackCommInfo* p = (struct CrackCommInfo*)ptr;
-    Dictionary* dict = p->dict;
-    Statistics* stats = p->stats;
-    sem_t* dataSem = p->dataSem;
-    struct crypt_data data;
-    memset(&data, 0, sizeof(struct crypt_data));
-    int numWords = p->dict->numWords;
-    int numThreads = p->numThreads;
-    int cryptRequests = 0;
-    int range = floor(numWords / numThreads);
-    char* cipherText = p->cipherText; 
-    char* cipherFromDict;
-    char* string;
-    int index = 0;
-    int endRange = 0;
-    char* result = "";
-    char* salt = retrieve_salt(cipherText);
-
-    take_lock(dataSem);
-    index = *(p->startIndex);
-    *(p->startIndex) += range;
-    *(p->threadsInitiated) += 1;
-    if (*(p->threadsInitiated) == numThreads) {
-	endRange = numWords;
-    } else {
-	endRange = index + range;
+    for (int i = 0; i < size; i++) {
+	out[i] = value >> (8 * (size - i - 1));
     }
-    release_lock(dataSem);
+}
 
-    while (index < endRange) {
-	if (*(p->found)) {
-	    break;
-	}
-	string = dict->words[index];
-	cipherFromDict = crypt_r(string, salt, &data);
-	update_crypt_calls(dataSem, stats);
-	cryptRequests++;
-	if (strcmp(cipherFromDict, cipherText) == 0) {
-	    take_lock(dataSem);
-	    *(p->found) = true;
-	    release_lock(dataSem);
-	    result = string;
-	    break;
-	}
-	index++;
+// Function that reads a big endian 16 or 32 bit value.
+uint32_t get_binary_value(unsigned char* in, int size) {
+
+    uint32_t value = 0;
+    for (int i = 0; i < size; i++) {
+	value = (value << 8) | in[i];
     }
-    return (void*)result;
+    return value;
 }
 
-// Function to check that the supplied arguments are valid. 
-// Takes in a list of string arguments, the list's length and the jobType 
+// Function that writes a binary frame header.
+void put_binary_header(unsigned char* out, BinaryFrameType type, int count,
+	int recordSize) {
+
+    put_binary_value(out, count * recordSize, 4);
+    out[4] = type;
+    out[5] = 0;
+    put_binary_value(out + 6, count, 2);
+}
+
+// Function that checks the binary frame at the start of the given data.
+// Returns the frame's total length (header included) once all of it is
+// there, 0 if more is needed or -1 if the frame is malformed - its type is
+// unknown, its length does not match its count of records or it is larger
+// than BIN_MAX_FRAME.
+int binary_frame_length(unsigned char* data, int available) {
+
+    if (available < BIN_HEADER_SIZE) {
+	return 0;
+    }
+    uint32_t length = get_binary_value(data, 4);
+    int count = get_binary_value(data + 6, 2);
+    int recordSize = data[4] == BIN_CRYPT ? BIN_CRYPT_SIZE
+	    : data[4] == BIN_CRACK ? BIN_CRACK_SIZE : 0;
+    if (recordSize == 0 || data[5] != 0 || count == 0
+	    || length != count * recordSize
+	    || length > BIN_MAX_FRAME - BIN_HEADER_SIZE) {
+	return -1;
+    }
+    return available < BIN_HEADER_SIZE + length ? 0
+	    : BIN_HEADER_SIZE + length;
+}
+
+// Function that returns the length of the response to the given (valid)
+// binary frame.
+int binary_response_length(unsigned char* frame) {
+
+    int count = get_binary_value(frame + 6, 2);
+    return BIN_HEADER_SIZE + count * (frame[4] == BIN_CRYPT
+	    ? BIN_CRYPT_RESULT_SIZE : BIN_CRACK_RESULT_SIZE);
+}
+
+// Function that answers the crypt requests of a binary frame, writing the
+// response frame to out. Each run of requests with the same salt is hashed
+// together - through the pool's crack backend for runs of at least half
+// its batch, otherwise through the crypt backend.
+void answer_binary_crypts(unsigned char* frame, ClientInfo* clientInfo,
+	unsigned char* out) {
+
+    int count = get_binary_value(frame + 6, 2);
+    unsigned char* records = frame + BIN_HEADER_SIZE;
+    uint64_t words[BIN_MAX_FRAME / BIN_CRYPT_SIZE];
+    int index[BIN_MAX_FRAME / BIN_CRYPT_SIZE];
+    uint64_t results[BIN_MAX_FRAME / BIN_CRYPT_SIZE];
+    char cipherText[MAX_CIPHER_SIZE + 1];
+    char salt[SALT_SIZE + 1] = {0};
+    update_crypt_requests(clientInfo->stats, count);
+    update_crypt_calls(clientInfo->stats, count);
+    put_binary_header(out, BIN_CRYPT, count, BIN_CRYPT_RESULT_SIZE);
+    out += BIN_HEADER_SIZE;
+    for (int start = 0, end; start < count; start = end) {
+	// The requests in [start, end) share a salt
+	memcpy(salt, records + start * BIN_CRYPT_SIZE + MAX_PHRASE_SIZE,
+		SALT_SIZE);
+	int numWords = 0;
+	bool validSalt = salt[0] && salt[1] && strchr(CHAR_SET, salt[0])
+		&& strchr(CHAR_SET, salt[1]);
+	for (end = start; end < count && !memcmp(salt, records
+		+ end * BIN_CRYPT_SIZE + MAX_PHRASE_SIZE, SALT_SIZE); end++) {
+	    unsigned char* result = out + end * BIN_CRYPT_RESULT_SIZE;
+	    char* word = (char*)records + end * BIN_CRYPT_SIZE;
+	    memset(result, 0, BIN_CRYPT_RESULT_SIZE);
+	    result[0] = BIN_INVALID;
+	    if (validSalt && word[0] != '\0') {
+		index[numWords] = end;
+		words[numWords++] = pack_word(word, strnlen(word,
+			MAX_PHRASE_SIZE));
+	    }
+	}
+	if (numWords == 0) {
+	    continue;
+	}
+	const CryptBackend* backend = clientInfo->pool->backend;
+	if (numWords < backend->batchSize / 2) {
+	    backend = clientInfo->pool->cryptBackend;
+	}
+	void* state = client_crypt_state(clientInfo, backend, salt);
+	for (int i = 0; i < numWords; i += backend->batchSize) {
+	    int batch = numWords - i < backend->batchSize ? numWords - i
+		    : backend->batchSize;
+	    backend->hash_batch(state, words + i, batch, results + i);
+	}
+	for (int i = 0; i < numWords; i++) {
+	    unsigned char* result = out + index[i] * BIN_CRYPT_RESULT_SIZE;
+	    encode_crypt_result(salt, results[i], cipherText);
+	    result[0] = BIN_OK;
+	    memcpy(result + 1, cipherText, MAX_CIPHER_SIZE);
+	}
+    }
+}
+
+// Function that submits the crack requests of a binary frame. Takes in the
+// frame, the client's ClientInfo, the complete function each request's
+// waiter is answered through (NULL to post its done semaphore instead) and
+// the owner of the requests (their Connection, if any). Returns the
+// submitted requests.
+BinaryCracks* submit_binary_cracks(unsigned char* frame,
+	ClientInfo* clientInfo, void (*complete)(CrackWaiter* waiter),
+	void* owner) {
+
+    int count = get_binary_value(frame + 6, 2);
+    unsigned char* records = frame + BIN_HEADER_SIZE;
+    BinaryCracks* cracks = calloc(1, sizeof(BinaryCracks));
+    cracks->count = count;
+    cracks->owner = owner;
+    cracks->waiters = calloc(count, sizeof(CrackWaiter));
+    cracks->cipherTexts = calloc(count, MAX_CIPHER_SIZE + 1);
+    cracks->valid = calloc(count, sizeof(bool));
+    for (int i = 0; i < count; i++) {
+	unsigned char* record = records + i * BIN_CRACK_SIZE;
+	char* cipherText = cracks->cipherTexts[i];
+	memcpy(cipherText, record, MAX_CIPHER_SIZE);
+	cipherText[MAX_CIPHER_SIZE] = '\0';
+	update_crack_requests(0, clientInfo->stats);
+	cracks->valid[i] = strlen(cipherText) == MAX_CIPHER_SIZE
+		&& strchr(CHAR_SET, cipherText[0])
+		&& strchr(CHAR_SET, cipherText[1])
+		&& record[MAX_CIPHER_SIZE] >= 1
+		&& record[MAX_CIPHER_SIZE] <= 50;
+	cracks->numValid += cracks->valid[i];
+    }
+    cracks->remaining = cracks->numValid;
+    for (int i = 0; i < count; i++) {
+	CrackWaiter* waiter = &cracks->waiters[i];
+	if (!cracks->valid[i]) {
+	    continue;
+	}
+	waiter->weight = records[i * BIN_CRACK_SIZE + MAX_CIPHER_SIZE];
+	waiter->cipherText = cracks->cipherTexts[i];
+	waiter->complete = complete;
+	waiter->owner = cracks;
+	if (complete == NULL) {
+	    init_lock(&waiter->done, 0);
+	    waiter->wakeFd = clientInfo->wakeFd;
+	}
+	submit_crack_request(clientInfo, waiter,
+		find_dictionary(clientInfo->pool->dictionaries, NULL), NULL,
+		NULL, false);
+    }
+    return cracks;
+}
+
+// Function that writes the response frame for a binary frame's crack
+// requests, once every one has been answered, to out (unless out is NULL,
+// as the client has gone), then frees them.
+void answer_binary_cracks(BinaryCracks* cracks, Statistics* stats,
+	unsigned char* out) {
+
+    if (out) {
+	put_binary_header(out, BIN_CRACK, cracks->count,
+		BIN_CRACK_RESULT_SIZE);
+	out += BIN_HEADER_SIZE;
+    }
+    for (int i = 0; i < cracks->count; i++) {
+	char* word = cracks->valid[i]
+		? crack_response(&cracks->waiters[i], stats) : NULL;
+	if (out == NULL) {
+	    continue;
+	}
+	unsigned char* result = out + i * BIN_CRACK_RESULT_SIZE;
+	memset(result, 0, BIN_CRACK_RESULT_SIZE);
+	result[0] = BIN_INVALID;
+	if (word) {
+	    result[0] = cracks->waiters[i].found ? BIN_OK : BIN_FAILED;
+	    if (cracks->waiters[i].found) {
+		strncpy((char*)result + 1, word, MAX_PHRASE_SIZE);
+	    }
+	}
+    }
+    free(cracks->waiters);
+    free(cracks->cipherTexts);
+    free(cracks->valid);
+    free(cracks);
+}
+
+// Function that serves a client thread's connection once it has switched
+// to the binary protocol, answering one frame at a time until the client
+// goes or sends a malformed frame (which is answered with an error frame).
+void serve_binary_client(FILE* from, ClientStream* stream,
+	ClientInfo* clientInfo) {
+
+    unsigned char frame[BIN_MAX_FRAME];
+    unsigned char response[BIN_MAX_RESPONSE];
+    int length;
+    while (fread(frame, 1, BIN_HEADER_SIZE, from) == BIN_HEADER_SIZE) {
+	if ((length = binary_frame_length(frame, BIN_MAX_FRAME)) < 0) {
+	    put_binary_header(response, BIN_ERROR, 0, 0);
+	    write_client_frame(stream, response, BIN_HEADER_SIZE);
+	    return;
+	}
+	if (fread(frame + BIN_HEADER_SIZE, 1, length - BIN_HEADER_SIZE,
+		from) != length - BIN_HEADER_SIZE) {
+	    return;
+	}
+	if (frame[4] == BIN_CRYPT) {
+	    answer_binary_crypts(frame, clientInfo, response);
+	} else {
+	    BinaryCracks* cracks = submit_binary_cracks(frame, clientInfo,
+		    NULL, NULL);
+	    bool cancelled = false;
+	    for (int i = 0; i < cracks->count; i++) {
+		if (cracks->valid[i]) {
+		    wait_for_crack(clientInfo, &cracks->waiters[i]);
+		    sem_destroy(&cracks->waiters[i].done);
+		    cancelled |= cracks->waiters[i].cancelled;
+		}
+	    }
+	    // A cancelled request means the client has hung up
+	    answer_binary_cracks(cracks, clientInfo->stats,
+		    cancelled ? NULL : response);
+	    if (cancelled) {
+		return;
+	    }
+	}
+	write_client_frame(stream, response, binary_response_length(frame));
+    }
+}
+
+// Function that writes a binary frame to a client thread's stream. The
+// frame is sent in one go, as stdio would split a frame larger than its
+// buffer and the small remainder could then wait on a delayed ack.
+void write_client_frame(ClientStream* stream, unsigned char* frame,
+	int length) {
+
+    int fd = fileno(stream->to);
+    take_lock(&stream->writeLock);
+    fflush(stream->to);
+    while (length > 0) {
+	ssize_t sent = send(fd, frame, length, MSG_NOSIGNAL);
+	if (sent < 0 && errno != EINTR) {
+	    break;
+	}
+	if (sent > 0) {
+	    frame += sent;
+	    length -= sent;
+	}
+    }
+    release_lock(&stream->writeLock);
+}
+
+// Function to add count crypt calls to the calling thread's shard of the
+// stats.
+void update_crypt_calls(Statistics* stats, long count) {
+    add_statistic(&stats_shard(stats)->cryptCalls, count);
+}
+
+// Function called by handle_command() to handle cracking requests.
+// The function takes in a list of string arguments which are used in the
+// cracking process, the length` of that list, a ClientInfo struct pointer
+// and the CrackWaiter to submit. The request joins the pass for its salt
+// over the dictionary named by an optional trailing argument (the default
+// dictionary if there is none), mangled by the rule set named by another
+// (the words as they are if there is none), or over pairs of its words
+// joined together if there is a trailing "+" argument, or instead over the
+// keyspace of a trailing mask, starting one if none is running. The
+// requested thread count only adds to the pass's share of the workers.
+// Unless the waiter has a complete function (in which case NULL is
+// returned straight away) this thread then waits until the request has
+// been answered. Returns ":failed"
+// if the cracking process did not find a matching cipher, the word of
+// the matching cipher, or NULL if the client hung up first.
+char* handle_crack_request(char** args, int length, ClientInfo* clientInfo,
+	CrackWaiter* waiter) {
+    // Skip over crack command
+    args++;
+    length--;
+    update_crack_requests(0, clientInfo->stats);
+    // Dictionary and rule set names and masks are never thread counts, and
+    // never name both
+    char* dictName = NULL;
+    RuleSet* rules = NULL;
+    Mask mask;
+    bool masked = false;
+    bool combine = false;
+    while (length > 1 && is_valid_number(args[length - 1]) != 0) {
+	char* name = args[--length];
+	name[strcspn(name, "\n")] = '\0';
+	RuleSet* named = find_rule_set(clientInfo->pool, name);
+	if (!strcmp(name, "+") && !combine) {
+	    combine = true;
+	} else if (is_mask(name)) {
+	    if (masked || !parse_mask(name, &mask)) {
+		return ":invalid";
+	    }
+	    masked = true;
+	} else if (named && rules == NULL) {
+	    rules = named;
+	} else if (named == NULL && dictName == NULL) {
+	    dictName = name;
+	} else {
+	    return ":invalid";
+	}
+    }
+    DictionarySource* source = find_dictionary(
+	    clientInfo->pool->dictionaries, dictName);
+    if (source == NULL || length > 2 || !valid_args(args, length, 1)
+	    || (masked && (dictName || rules || combine))
+	    || (combine && rules)) {
+	return ":invalid";
+    }
+    waiter->weight = 1;
+    if (length > 1) {
+	waiter->weight = atoi(args[1]);
+    }
+    waiter->cipherText = args[0];
+    waiter->found = false;
+    waiter->result[0] = '\0';
+    if (waiter->complete) {
+	submit_crack_request(clientInfo, waiter, source, rules,
+		masked ? &mask : NULL, combine);
+	return NULL;
+    }
+    init_lock(&waiter->done, 0);
+    waiter->wakeFd = clientInfo->wakeFd;
+    submit_crack_request(clientInfo, waiter, source, rules,
+	    masked ? &mask : NULL, combine);
+    wait_for_crack(clientInfo, waiter);
+    sem_destroy(&waiter->done);
+    return crack_response(waiter, clientInfo->stats);
+}
+
+// Function that waits (in a client thread) for a crack request to be
+// answered, watching the client's socket and the thread's eventfd at once.
+// If the client closes or resets its connection first the request is
+// cancelled. A client that only shuts down its sending side looks the
+// same, so half-closed connections are not supported.
+void wait_for_crack(ClientInfo* clientInfo, CrackWaiter* waiter) {
+
+    uint64_t count;
+    struct pollfd fds[2] = {
+	{.fd = *clientInfo->connectedFd, .events = POLLRDHUP},
+	{.fd = clientInfo->wakeFd, .events = POLLIN}};
+    while (sem_trywait(&waiter->done) != 0) {
+	if (poll(fds, 2, -1) < 0) {
+	    continue;
+	}
+	if (fds[0].revents & (POLLRDHUP | POLLHUP | POLLERR)) {
+	    take_lock(&clientInfo->pool->schedLock);
+	    cancel_waiter(clientInfo->pool, waiter);
+	    release_lock(&clientInfo->pool->schedLock);
+	    take_lock(&waiter->done);
+	    return;
+	}
+	// The eventfd may have been bumped for another of the thread's
+	// requests, done says whether this one was answered
+	if ((fds[1].revents & POLLIN)
+		&& read(clientInfo->wakeFd, &count, sizeof(uint64_t)) < 0) {
+	    continue;
+	}
+    }
+}
+
+// Function that records the outcome of an answered crack request in the
+// statistics (a cancelled request counts as failed). Returns ":failed", the
+// word of the matching cipher, or NULL if the request was cancelled as its
+// client has gone, in which case no response must be sent.
+char* crack_response(CrackWaiter* waiter, Statistics* stats) {
+
+    if (waiter->cancelled) {
+	update_crack_requests(1, stats);
+	return NULL;
+    }
+    if (waiter->found) {
+	update_crack_requests(2, stats);
+	return waiter->result;
+    }
+    update_crack_requests(1, stats);
+    return ":failed";
+}
+
+// Function that creates the given number of I/O threads for epoll mode,
+// each with its own epoll instance watching its eventfd. Returns the
+// array of threads.
+IoThread* create_io_threads(int numThreads) {
+
+    IoThread* ioThreads = calloc(numThreads, sizeof(IoThread));
+    for (int i = 0; i < numThreads; i++) {
+	IoThread* io = &ioThreads[i];
+	struct epoll_event event;
+	memset(&event, 0, sizeof(struct epoll_event));
+	io->epollFd = epoll_create1(EPOLL_CLOEXEC);
+	io->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (io->epollFd < 0 || io->wakeFd < 0) {
+	    socket_open_error();
+	}
+	// The eventfd is the only thing watched with a NULL pointer
+	event.events = EPOLLIN;
+	event.data.ptr = NULL;
+	epoll_ctl(io->epollFd, EPOLL_CTL_ADD, io->wakeFd, &event);
+	init_lock(&io->queueLock, 1);
+	pthread_create(&io->tid, NULL, io_thread, io);
+	pthread_detach(io->tid);
+    }
+    return ioThreads;
+}
+
+// Function that wakes the given I/O thread by bumping its eventfd.
+void wake_io_thread(IoThread* io) {
+
+    uint64_t one = 1;
+    if (write(io->wakeFd, &one, sizeof(uint64_t)) < 0) {
+	// Already pending, the thread will wake anyway
+	return;
+    }
+}
+
+// Function that creates the connection for a newly accepted client of the
+// given I/O thread. Takes in the thread, the client's socket and its
+// ClientInfo (which is copied). Returns the new connection.
+Connection* create_connection(IoThread* io, int fd, ClientInfo* clientInfo) {
+
+    Connection* conn = calloc(1, sizeof(Connection));
+    conn->fd = fd;
+    conn->io = io;
+    conn->info = *clientInfo;
+    conn->readCapacity = CONN_BUFFER_SIZE;
+    conn->readBuffer = malloc(conn->readCapacity);
+    conn->waiter.complete = complete_connection_crack;
+    conn->waiter.owner = conn;
+    return conn;
+}
+
+// Function that hands a newly accepted client to the given I/O thread.
+// Takes in the thread, the client's socket and its ClientInfo (which is
+// copied into the connection and freed).
+void add_connection(IoThread* io, int fd, ClientInfo* clientInfo) {
+
+    Connection* conn = create_connection(io, fd, clientInfo);
+    free(clientInfo);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    take_lock(&io->queueLock);
+    conn->next = io->incoming;
+    io->incoming = conn;
+    release_lock(&io->queueLock);
+    wake_io_thread(io);
+}
+
+// Thread function run by every I/O thread in epoll mode. Takes in a void*
+// which is the IoThread. Waits for its connections to become readable or
+// writable and for new or answered connections to be queued, serving each
+// in turn. Connections closed while handling a batch of events are freed
+// once the batch is done. Never returns.
+void* io_thread(void* ptr) {
+
+    IoThread* io = (IoThread*)ptr;
+    struct epoll_event events[IO_EVENTS];
+    uint64_t count;
+    while (1) {
+	int numEvents = epoll_wait(io->epollFd, events, IO_EVENTS, -1);
+	for (int i = 0; i < numEvents; i++) {
+	    Connection* conn = (Connection*)events[i].data.ptr;
+	    if (conn == NULL) {
+		if (read(io->wakeFd, &count, sizeof(uint64_t)) < 0) {
+		    continue;
+		}
+		take_lock(&io->queueLock);
+		Connection* incoming = io->incoming;
+		io->incoming = NULL;
+		release_lock(&io->queueLock);
+		while (incoming) {
+		    Connection* next = incoming->next;
+		    watch_connection(incoming);
+		    incoming = next;
+		}
+		answer_completed_connections(io);
+		continue;
+	    }
+	    if (conn->closed) {
+		continue;
+	    }
+	    if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+		conn->hungUp = true;
+	    }
+	    if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+		read_connection(conn);
+	    }
+	    if (events[i].events & EPOLLOUT) {
+		flush_connection(conn);
+	    }
+	    service_connection(conn);
+	}
+	free_dead_connections(io);
+    }
+    return (void*)0;
+}
+
+// Function that sends the response of every connection of the given I/O
+// thread whose crack request has been answered, and of every answered
+// tagged request, then moves each connection along.
+void answer_completed_connections(IoThread* io) {
+
+    char line[MAX_TAG_SIZE + BUFFER_SIZE + 3];
+    take_lock(&io->queueLock);
+    Connection* completed = io->completed;
+    TaggedRequest* answered = io->answered;
+    io->completed = NULL;
+    io->answered = NULL;
+    release_lock(&io->queueLock);
+    while (answered) {
+	TaggedRequest* next = answered->next;
+	Connection* conn = (Connection*)answered->owner;
+	char* result = crack_response(&answered->waiter, conn->info.stats);
+	conn->tagsPending--;
+	unlink_tagged_request(&conn->tags, answered);
+	if (result && !conn->failed) {
+	    queue_response(conn, tag_response(answered->tag, result, line));
+	}
+	free(answered);
+	service_connection(conn);
+	answered = next;
+    }
+    while (completed) {
+	Connection* next = completed->next;
+	BinaryCracks* cracks = completed->binaryCracks;
+	completed->crackPending = false;
+	if (cracks) {
+	    completed->binaryCracks = NULL;
+	    answer_binary_cracks(cracks, completed->info.stats,
+		    completed->failed ? NULL : (unsigned char*)
+		    reserve_response(completed, BIN_HEADER_SIZE
+		    + cracks->count * BIN_CRACK_RESULT_SIZE));
+	} else {
+	    char* result = crack_response(&completed->waiter,
+		    completed->info.stats);
+	    if (result && !completed->failed) {
+		queue_response(completed, result);
+	    }
+	}
+	service_connection(completed);
+	completed = next;
+    }
+}
+
+// Function that frees the connections of the given I/O thread that were
+// closed while it handled its last batch of events.
+void free_dead_connections(IoThread* io) {
+
+    while (io->dead) {
+	Connection* next = io->dead->next;
+	free(io->dead->readBuffer);
+	free(io->dead->writeBuffer);
+	free(io->dead->retiredBuffer);
+	free(io->dead);
+	io->dead = next;
+    }
+}
+
+// Function that starts serving a new connection on its I/O thread,
+// answering anything it has already sent.
+void watch_connection(Connection* conn) {
+
+    conn->events = 0;
+    conn->watched = false;
+    service_connection(conn);
+}
+
+// Function that updates which events a connection's I/O thread waits for:
+// input while there is room to buffer it and output while some is waiting
+// to be sent, and for the client closing its connection while a crack
+// request is pending (even if its input is not being read). A connection
+// waiting on nothing is not watched at all, so a hung up socket cannot
+// wake the thread over and over.
+void update_connection_events(Connection* conn) {
+
+    struct epoll_event event;
+    uint32_t events = 0;
+    if (!conn->failed && !conn->readClosed
+	    && conn->readLength < CONN_BUFFER_SIZE) {
+	events |= EPOLLIN;
+    }
+    if (!conn->failed && !conn->hungUp
+	    && (conn->crackPending || conn->tagsPending > 0)) {
+	events |= EPOLLRDHUP;
+    }
+    if (!conn->failed && conn->writeLength > conn->writeOffset) {
+	events |= EPOLLOUT;
+    }
+    memset(&event, 0, sizeof(struct epoll_event));
+    event.events = events;
+    event.data.ptr = conn;
+    if (events == 0) {
+	if (conn->watched) {
+	    epoll_ctl(conn->io->epollFd, EPOLL_CTL_DEL, conn->fd, NULL);
+	    conn->watched = false;
+	}
+    } else if (!conn->watched) {
+	if (epoll_ctl(conn->io->epollFd, EPOLL_CTL_ADD, conn->fd, &event)) {
+	    conn->failed = true;
+	    return;
+	}
+	conn->watched = true;
+    } else if (events != conn->events) {
+	epoll_ctl(conn->io->epollFd, EPOLL_CTL_MOD, conn->fd, &event);
+    }
+    conn->events = events;
+}
+
+// Function that reads whatever a connection has sent into its read buffer,
+// until the socket has nothing more or the buffer is full. Notes when the
+// client has closed its end or the socket has failed.
+void read_connection(Connection* conn) {
+
+    while (conn->readLength < CONN_BUFFER_SIZE && !conn->readClosed) {
+	ssize_t got = recv(conn->fd, conn->readBuffer + conn->readLength,
+		CONN_BUFFER_SIZE - conn->readLength, 0);
+	if (got > 0) {
+	    conn->readLength += got;
+	} else if (got == 0) {
+	    conn->readClosed = true;
+	} else if (errno == EINTR) {
+	    continue;
+	} else {
+	    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+		conn->readClosed = true;
+		conn->failed = true;
+	    }
+	    break;
+	}
+    }
+}
+
+// Function that sends as much of a connection's write buffer as the socket
+// will take without blocking. With io_uring a send of everything waiting is
+// submitted instead, unless one is already in flight.
+void flush_connection(Connection* conn) {
+
+#ifdef HAVE_IO_URING
+    if (conn->io->ring) {
+	arm_ring_send(conn);
+	return;
+    }
+#endif
+
+    while (conn->writeOffset < conn->writeLength && !conn->failed) {
+	ssize_t sent = send(conn->fd, conn->writeBuffer + conn->writeOffset,
+		conn->writeLength - conn->writeOffset, MSG_NOSIGNAL);
+	if (sent >= 0) {
+	    conn->writeOffset += sent;
+	} else if (errno == EINTR) {
+	    continue;
+	} else {
+	    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+		conn->failed = true;
+	    }
+	    break;
+	}
+    }
+    if (conn->writeOffset == conn->writeLength) {
+	conn->writeOffset = conn->writeLength = 0;
+    }
+}
+
+// Function that adds a response line to a connection's write buffer.
+void queue_response(Connection* conn, char* response) {
+
+    int length = strlen(response);
+    char* out = reserve_response(conn, length + 1);
+    memcpy(out, response, length);
+    out[length] = '\n';
+}
+
+// Function that makes room for length more bytes at the end of a
+// connection's write buffer. Returns where they go.
+char* reserve_response(Connection* conn, int length) {
+
+    if (conn->writeLength + length > conn->writeCapacity) {
+	if (conn->writeOffset > 0 && !conn->sendArmed) {
+	    memmove(conn->writeBuffer, conn->writeBuffer + conn->writeOffset,
+		    conn->writeLength - conn->writeOffset);
+	    conn->writeLength -= conn->writeOffset;
+	    conn->writeOffset = 0;
+	}
+	while (conn->writeLength + length > conn->writeCapacity) {
+	    conn->writeCapacity = conn->writeCapacity ? conn->writeCapacity * 2
+		    : BUFFER_SIZE * 2;
+	}
+	if (conn->sendArmed) {
+	    // The kernel may still be reading the buffer the send was
+	    // submitted with, so keep it until the send completes
+	    char* buffer = malloc(conn->writeCapacity);
+	    memcpy(buffer, conn->writeBuffer, conn->writeLength);
+	    if (conn->retiredBuffer) {
+		free(conn->writeBuffer);
+	    } else {
+		conn->retiredBuffer = conn->writeBuffer;
+	    }
+	    conn->writeBuffer = buffer;
+	} else {
+	    conn->writeBuffer = realloc(conn->writeBuffer,
+		    conn->writeCapacity);
+	}
+    }
+    conn->writeLength += length;
+    return conn->writeBuffer + conn->writeLength - length;
+}
+
+// Function that returns the length of the next line in a connection's read
+// buffer, split the same way fgets() with a BUFFER_SIZE buffer would: up to
+// and including a newline, at most BUFFER_SIZE - 1 characters, or whatever
+// is left once the client has closed its end. Returns 0 if there is no
+// complete line yet.
+int next_line_length(Connection* conn) {
+
+    int limit = conn->readLength < BUFFER_SIZE - 1 ? conn->readLength
+	    : BUFFER_SIZE - 1;
+    char* newline = memchr(conn->readBuffer, '\n', limit);
+    if (newline) {
+	return newline - conn->readBuffer + 1;
+    } else if (limit == BUFFER_SIZE - 1 || conn->readClosed) {
+	return limit;
+    }
+    return 0;
+}
+
+// Function that returns the length of the next binary frame in a
+// connection's read buffer, or 0 if it is not all there yet. A malformed
+// frame is answered with an error frame, and anything the client sends
+// after it (or an incomplete frame once the client has closed its end) is
+// thrown away.
+int next_frame_length(Connection* conn) {
+
+    unsigned char* data = (unsigned char*)conn->readBuffer;
+    int length = binary_frame_length(data, conn->readLength);
+    if (length < 0) {
+	put_binary_header((unsigned char*)reserve_response(conn,
+		BIN_HEADER_SIZE), BIN_ERROR, 0, 0);
+	conn->readClosed = true;
+    }
+    if (length < 0 || (length == 0 && conn->readClosed)) {
+	conn->readLength = 0;
+	return 0;
+    }
+    return length;
+}
+
+// Function that answers the binary frame of the given length at the start
+// of a connection's read buffer. Crack requests are submitted and the
+// connection waits for every one to be answered, as it would for a crack
+// request line.
+void answer_connection_frame(Connection* conn, int length) {
+
+    unsigned char* frame = (unsigned char*)conn->readBuffer;
+    if (frame[4] == BIN_CRYPT) {
+	answer_binary_crypts(frame, &conn->info, (unsigned char*)
+		reserve_response(conn, binary_response_length(frame)));
+    } else {
+	conn->crackPending = true;
+	conn->binaryCracks = submit_binary_cracks(frame, &conn->info,
+		complete_connection_cracks, conn);
+	if (conn->binaryCracks->numValid == 0) {
+	    // Nothing valid was submitted
+	    answer_binary_cracks(conn->binaryCracks, conn->info.stats,
+		    (unsigned char*)reserve_response(conn,
+		    binary_response_length(frame)));
+	    conn->binaryCracks = NULL;
+	    conn->crackPending = false;
+	}
+    }
+    conn->readLength -= length;
+    memmove(conn->readBuffer, conn->readBuffer + length, conn->readLength);
+}
+
+// Function that moves a connection along: answers its buffered lines in
+// order until a crack request is pending or too much output is waiting to
+// be sent, sends what it can, then either closes the connection (once the
+// client is done with it) or updates what its I/O thread waits for.
+void service_connection(Connection* conn) {
+
+    int length;
+    char tag[MAX_TAG_SIZE + 1];
+    char response[MAX_TAG_SIZE + BUFFER_SIZE + 3];
+    if ((conn->hungUp || conn->readClosed || conn->failed)
+	    && !conn->cancelled
+	    && (conn->crackPending || conn->tagsPending > 0)) {
+	cancel_connection_cracks(conn);
+    }
+    while (!conn->crackPending && !conn->failed
+	    && conn->writeLength - conn->writeOffset < CONN_WRITE_LIMIT
+	    && (length = conn->binary ? next_frame_length(conn)
+	    : next_line_length(conn)) > 0) {
+	if (conn->binary) {
+	    answer_connection_frame(conn, length);
+	    continue;
+	}
+	memcpy(conn->line, conn->readBuffer, length);
+	conn->line[length] = '\0';
+	conn->readLength -= length;
+	memmove(conn->readBuffer, conn->readBuffer + length,
+		conn->readLength);
+	if (strcmp(conn->line, BIN_HANDSHAKE) == 0) {
+	    queue_response(conn, "binary");
+	    conn->binary = true;
+	    continue;
+	}
+	char* command = split_request_tag(conn->line, tag);
+	char* result = ":invalid";
+	if (command != NULL && tag[0] != '\0') {
+	    result = handle_connection_tagged_request(conn, tag, command);
+	} else if (command != NULL) {
+	    result = handle_command(command, &conn->info, &conn->waiter);
+	    conn->crackPending = result == NULL;
+	}
+	if (result != NULL) {
+	    queue_response(conn, tag_response(tag, result, response));
+	}
+    }
+    flush_connection(conn);
+    // A connection with a pending crack request (tagged or not) is closed
+    // once the worker hands the waiter back
+    if (!conn->crackPending && conn->tagsPending == 0 && (conn->failed
+	    || (conn->readClosed && conn->readLength == 0
+	    && conn->writeLength == 0))) {
+#ifdef HAVE_IO_URING
+	if (conn->opsPending > 0) {
+	    // Closed once the ring is done with it, shutting the socket
+	    // down ends any recv still waiting
+	    if (!conn->shutDown) {
+		shutdown(conn->fd, SHUT_RDWR);
+		conn->shutDown = true;
+	    }
+	    return;
+	}
+#endif
+	close_connection(conn);
+	return;
+    }
+#ifdef HAVE_IO_URING
+    if (conn->io->ring) {
+	arm_ring_recv(conn);
+	return;
+    }
+#endif
+    update_connection_events(conn);
+}
+
+// Function that cancels a connection's pending crack requests (tagged or
+// not) once its client has closed its connection or the connection has
+// failed. Nothing
+// more is answered for it, the connection is closed once the workers have
+// handed back every request.
+void cancel_connection_cracks(Connection* conn) {
+
+    WorkerPool* pool = conn->info.pool;
+    BinaryCracks* cracks = conn->binaryCracks;
+    take_lock(&pool->schedLock);
+    if (cracks) {
+	for (int i = 0; i < cracks->count; i++) {
+	    if (cracks->valid[i]) {
+		cancel_waiter(pool, &cracks->waiters[i]);
+	    }
+	}
+    } else if (conn->crackPending) {
+	cancel_waiter(pool, &conn->waiter);
+    }
+    cancel_tagged_requests(pool, conn->tags);
+    release_lock(&pool->schedLock);
+    conn->cancelled = true;
+    conn->failed = true;
+}
+
+// Function called by a crack worker (with the pool's schedLock held) once
+// one of the crack requests of a connection's binary frame has been
+// answered. The connection is queued for its I/O thread once all have.
+void complete_connection_cracks(CrackWaiter* waiter) {
+
+    BinaryCracks* cracks = (BinaryCracks*)waiter->owner;
+    Connection* conn = (Connection*)cracks->owner;
+    if (--cracks->remaining == 0) {
+	complete_connection_crack(&conn->waiter);
+    }
+}
+
+// Function that answers a tagged request for a connection. Takes in the
+// connection, the tag and the command. A crack request is answered through
+// its I/O thread once finished and NULL returned, anything else is
+// answered straight away. Returns the response.
+char* handle_connection_tagged_request(Connection* conn, char* tag,
+	char* command) {
+
+    TaggedRequest* request = create_tagged_request(tag, command, conn,
+	    complete_connection_tag);
+    char* result = handle_command(request->line, &conn->info,
+	    &request->waiter);
+    if (result == NULL) {
+	conn->tagsPending++;
+	link_tagged_request(&conn->tags, request);
+	return NULL;
+    }
+    free(request);
+    return result;
+}
+
+// Function called by a crack worker (with the pool's schedLock held) once a
+// connection's tagged crack request has been answered. Queues the request
+// for the connection's I/O thread, which sends the response.
+void complete_connection_tag(CrackWaiter* waiter) {
+
+    TaggedRequest* request = (TaggedRequest*)waiter->owner;
+    IoThread* io = ((Connection*)request->owner)->io;
+    take_lock(&io->queueLock);
+    request->next = io->answered;
+    io->answered = request;
+    release_lock(&io->queueLock);
+    wake_io_thread(io);
+}
+
+// Function called by a crack worker (with the pool's schedLock held) once a
+// connection's crack request has been answered. Queues the connection for
+// its I/O thread, which sends the response.
+void complete_connection_crack(CrackWaiter* waiter) {
+
+    Connection* conn = (Connection*)waiter->owner;
+    IoThread* io = conn->io;
+    take_lock(&io->queueLock);
+    conn->next = io->completed;
+    io->completed = conn;
+    release_lock(&io->queueLock);
+    wake_io_thread(io);
+}
+
+// Function that closes a finished connection, updating the statistics and
+// allowing another client to connect. The connection itself is freed by
+// its I/O thread once it has finished the current batch of events.
+void close_connection(Connection* conn) {
+
+    ClientInfo* clientInfo = &conn->info;
+    conn->closed = true;
+    close(conn->fd);
+    update_client_count(1, clientInfo->stats);
+    update_completed_clients(clientInfo->stats);
+    if (clientInfo->params.connections != 0) {
+	release_lock(clientInfo->clientSem);
+    }
+    free(clientInfo->cryptState);
+    free(clientInfo->batchState);
+    conn->next = conn->io->dead;
+    conn->io->dead = conn;
+}
+
+#ifdef HAVE_IO_URING
+// Function that returns true if the kernel behind the given io_uring
+// supports every operation the ring thread submits.
+bool io_ring_supports_ops(int ringFd) {
+
+    int ops[] = {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND,
+	    IORING_OP_READ, IORING_OP_ASYNC_CANCEL};
+    int numOps = 256;
+    bool supported = true;
+    struct io_uring_probe* probe = calloc(1, sizeof(struct io_uring_probe)
+	    + numOps * sizeof(struct io_uring_probe_op));
+    if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PROBE,
+	    probe, numOps) < 0) {
+	free(probe);
+	return false;
+    }
+    for (int i = 0; i < sizeof(ops) / sizeof(int); i++) {
+	if (ops[i] > probe->last_op
+		|| !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+	    supported = false;
+	}
+    }
+    free(probe);
+    return supported;
+}
+
+// Function that creates an io_uring instance for the ring thread with raw
+// system calls, accepting from the given listening socket and giving each
+// client a copy of the given ClientInfo. Multishot accept is only used when
+// the number of clients is not limited, and multishot recv only if the
+// kernel takes a ring of provided buffers. Returns NULL if the kernel does
+// not support everything needed.
+IoRing* create_io_ring(int listenFd, ClientInfo* clientInfo) {
+
+    struct io_uring_params setup;
+    memset(&setup, 0, sizeof(struct io_uring_params));
+    int fd = syscall(__NR_io_uring_setup, IO_RING_ENTRIES, &setup);
+    if (fd < 0) {
+	return NULL;
+    }
+    if (!(setup.features & IORING_FEAT_SINGLE_MMAP)
+	    || !io_ring_supports_ops(fd)) {
+	close(fd);
+	return NULL;
+    }
+    // With a single mapping the completion ring shares the submission
+    // ring's pages
+    size_t ringSize = setup.sq_off.array
+	    + setup.sq_entries * sizeof(unsigned);
+    size_t cqSize = setup.cq_off.cqes
+	    + setup.cq_entries * sizeof(struct io_uring_cqe);
+    ringSize = cqSize > ringSize ? cqSize : ringSize;
+    size_t sqeSize = setup.sq_entries * sizeof(struct io_uring_sqe);
+    char* rings = mmap(NULL, ringSize, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    void* sqes = mmap(NULL, sqeSize, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (rings == MAP_FAILED || sqes == MAP_FAILED) {
+	if (rings != MAP_FAILED) {
+	    munmap(rings, ringSize);
+	}
+	if (sqes != MAP_FAILED) {
+	    munmap(sqes, sqeSize);
+	}
+	close(fd);
+	return NULL;
+    }
+
+    IoRing* ring = calloc(1, sizeof(IoRing));
+    ring->fd = fd;
+    ring->sqHead = (unsigned*)(rings + setup.sq_off.head);
+    ring->sqTail = (unsigned*)(rings + setup.sq_off.tail);
+    ring->sqMask = *(unsigned*)(rings + setup.sq_off.ring_mask);
+    ring->sqArray = (unsigned*)(rings + setup.sq_off.array);
+    ring->sqEntries = setup.sq_entries;
+    ring->sqLocalTail = *ring->sqTail;
+    ring->sqes = (struct io_uring_sqe*)sqes;
+    ring->cqHead = (unsigned*)(rings + setup.cq_off.head);
+    ring->cqTail = (unsigned*)(rings + setup.cq_off.tail);
+    ring->cqMask = *(unsigned*)(rings + setup.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(rings + setup.cq_off.cqes);
+    // Entry i of the submission ring is always sqes[i]
+    for (unsigned i = 0; i < ring->sqEntries; i++) {
+	ring->sqArray[i] = i;
+    }
+    ring->listenFd = listenFd;
+    ring->clientInfo = *clientInfo;
+#ifdef IORING_ACCEPT_MULTISHOT
+    ring->multishotAccept = clientInfo->params.connections == 0;
+#endif
+    ring->multishotRecv = create_ring_buffers(ring);
+    return ring;
+}
+
+// Function that registers the ring of provided buffers that multishot
+// recvs fill, as buffer group 0 of the given io_uring, and hands the kernel
+// every buffer. Returns false if the kernel does not support it.
+bool create_ring_buffers(IoRing* ring) {
+
+#ifdef IORING_RECV_MULTISHOT
+    struct io_uring_buf_reg reg;
+    size_t size = IO_RING_BUFFERS * sizeof(struct io_uring_buf);
+    // The buffer ring must be page aligned
+    void* bufRing = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (bufRing == MAP_FAILED) {
+	return false;
+    }
+    memset(&reg, 0, sizeof(struct io_uring_buf_reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)bufRing;
+    reg.ring_entries = IO_RING_BUFFERS;
+    reg.bgid = 0;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING,
+	    &reg, 1) < 0) {
+	munmap(bufRing, size);
+	return false;
+    }
+    ring->bufRing = (struct io_uring_buf_ring*)bufRing;
+    ring->buffers = malloc(IO_RING_BUFFERS * IO_RING_BUFFER_SIZE);
+    for (int i = 0; i < IO_RING_BUFFERS; i++) {
+	return_ring_buffer(ring, i);
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Function that hands the provided buffer with the given id back to the
+// kernel once its data has been copied out.
+void return_ring_buffer(IoRing* ring, int bufferId) {
+
+    struct io_uring_buf* buf = &ring->bufRing->bufs[ring->bufTail
+	    & (IO_RING_BUFFERS - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(ring->buffers
+	    + bufferId * IO_RING_BUFFER_SIZE);
+    buf->len = IO_RING_BUFFER_SIZE;
+    buf->bid = bufferId;
+    ring->bufTail++;
+    __atomic_store_n(&ring->bufRing->tail, ring->bufTail, __ATOMIC_RELEASE);
+}
+
+// Function that returns the next free submission queue entry of the given
+// io_uring, cleared. Entries are only handed to the kernel by
+// submit_io_ring(), which is called first if the queue is full.
+struct io_uring_sqe* io_ring_sqe(IoRing* ring) {
+
+    if (ring->sqLocalTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE)
+	    >= ring->sqEntries) {
+	submit_io_ring(ring, false);
+    }
+    struct io_uring_sqe* sqe = &ring->sqes[ring->sqLocalTail & ring->sqMask];
+    ring->sqLocalTail++;
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    return sqe;
+}
+
+// Function that hands every entry filled in since the last call to the
+// kernel in a single system call, then (if wait is true) waits for at least
+// one completion.
+void submit_io_ring(IoRing* ring, bool wait) {
+
+    __atomic_store_n(ring->sqTail, ring->sqLocalTail, __ATOMIC_RELEASE);
+    while (1) {
+	unsigned pending = ring->sqLocalTail
+		- __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+	if (pending == 0 && !wait) {
+	    return;
+	}
+	if (syscall(__NR_io_uring_enter, ring->fd, pending, wait ? 1 : 0,
+		wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0) >= 0
+		|| errno != EINTR) {
+	    return;
+	}
+    }
+}
+
+// Function that submits an accept on the ring's listening socket. When the
+// number of clients is limited a slot is taken first, and nothing is
+// submitted if there is none free - close_connection() frees one and the
+// ring thread tries again after every batch of completions.
+void arm_ring_accept(IoRing* ring) {
+
+    ClientInfo* clientInfo = &ring->clientInfo;
+    if (clientInfo->params.connections != 0
+	    && sem_trywait(clientInfo->clientSem) != 0) {
+	return;
+    }
+    struct io_uring_sqe* sqe = io_ring_sqe(ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = ring->listenFd;
+    sqe->user_data = RING_ACCEPT;
+#ifdef IORING_ACCEPT_MULTISHOT
+    if (ring->multishotAccept) {
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    }
+#endif
+    ring->acceptArmed = true;
+}
+
+// Function that submits a read of the ring thread's eventfd, which
+// completes when a crack worker has answered one of its connections.
+void arm_ring_wake(IoThread* io) {
+
+    struct io_uring_sqe* sqe = io_ring_sqe(io->ring);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = io->wakeFd;
+    sqe->addr = (uint64_t)(uintptr_t)&io->ring->wakeValue;
+    sqe->len = sizeof(uint64_t);
+    sqe->user_data = RING_WAKE;
+}
+
+// Function that makes sure a recv is in flight for a connection while it
+// has room to buffer more input. A multishot recv stays in flight, so it is
+// cancelled instead once the connection's read buffer is full.
+void arm_ring_recv(Connection* conn) {
+
+    IoRing* ring = conn->io->ring;
+    bool wanted = !conn->failed && !conn->readClosed
+	    && conn->readLength < CONN_BUFFER_SIZE;
+    if (conn->recvArmed) {
+	if (!wanted && ring->multishotRecv && !conn->cancelPending) {
+	    struct io_uring_sqe* sqe = io_ring_sqe(ring);
+	    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	    sqe->addr = (uintptr_t)conn | RING_RECV;
+	    sqe->user_data = (uintptr_t)conn | RING_CANCEL;
+	    conn->cancelPending = true;
+	    conn->opsPending++;
+	}
+	return;
+    }
+    if (!wanted) {
+	return;
+    }
+    struct io_uring_sqe* sqe = io_ring_sqe(ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->user_data = (uintptr_t)conn | RING_RECV;
+#ifdef IORING_RECV_MULTISHOT
+    if (ring->multishotRecv) {
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = 0;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+    } else
+#endif
+    {
+	sqe->addr = (uintptr_t)conn->recvBuffer;
+	sqe->len = IO_RING_BUFFER_SIZE;
+    }
+    conn->recvArmed = true;
+    conn->opsPending++;
+}
+
+// Function that submits a send of everything waiting in a connection's
+// write buffer, unless one is already in flight.
+void arm_ring_send(Connection* conn) {
+
+    if (conn->sendArmed || conn->failed
+	    || conn->writeOffset == conn->writeLength) {
+	return;
+    }
+    struct io_uring_sqe* sqe = io_ring_sqe(conn->io->ring);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->fd;
+    sqe->addr = (uintptr_t)(conn->writeBuffer + conn->writeOffset);
+    sqe->len = conn->writeLength - conn->writeOffset;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uintptr_t)conn | RING_SEND;
+    conn->sendArmed = true;
+    conn->opsPending++;
+}
+
+// Function that handles a completed accept: the new client's connection is
+// created and a recv submitted for it. A failed accept gives its slot back.
+void ring_accept_done(IoThread* io, int res, unsigned flags) {
+
+    IoRing* ring = io->ring;
+    ClientInfo* clientInfo = &ring->clientInfo;
+    if (!(flags & IORING_CQE_F_MORE)) {
+	ring->acceptArmed = false;
+    }
+    if (res >= 0) {
+	update_client_count(0, clientInfo->stats);
+	service_connection(create_connection(io, res, clientInfo));
+	return;
+    }
+    if (clientInfo->params.connections != 0) {
+	release_lock(clientInfo->clientSem);
+    }
+    if (res == -EINVAL && ring->multishotAccept) {
+	// The kernel does not support multishot accept after all
+	ring->multishotAccept = false;
+    } else if (res != -ECONNABORTED && res != -EINTR && res != -ECANCELED) {
+	socket_open_error();
+    }
+}
+
+// Function that handles a completed recv (or one result of a multishot
+// recv): the data is added to the connection's read buffer, which grows if
+// a multishot recv delivers more before it is cancelled.
+void ring_recv_done(Connection* conn, int res, unsigned flags) {
+
+    IoRing* ring = conn->io->ring;
+    if (!(flags & IORING_CQE_F_MORE)) {
+	conn->recvArmed = false;
+	conn->opsPending--;
+    }
+    if (res > 0) {
+	char* data = conn->recvBuffer;
+	int bufferId = flags >> IORING_CQE_BUFFER_SHIFT;
+	if (flags & IORING_CQE_F_BUFFER) {
+	    data = ring->buffers + bufferId * IO_RING_BUFFER_SIZE;
+	}
+	if (conn->readLength + res > conn->readCapacity) {
+	    while (conn->readLength + res > conn->readCapacity) {
+		conn->readCapacity *= 2;
+	    }
+	    conn->readBuffer = realloc(conn->readBuffer, conn->readCapacity);
+	}
+	memcpy(conn->readBuffer + conn->readLength, data, res);
+	conn->readLength += res;
+	if (flags & IORING_CQE_F_BUFFER) {
+	    return_ring_buffer(ring, bufferId);
+	}
+    } else if (res == 0) {
+	conn->readClosed = true;
+    } else if (res == -EINVAL && ring->multishotRecv) {
+	// The kernel does not support multishot recv after all
+	ring->multishotRecv = false;
+    } else if (res != -ENOBUFS && res != -ECANCELED && res != -EINTR) {
+	// Out of provided buffers or cancelled recvs are submitted again
+	// once the connection has room
+	conn->readClosed = true;
+	conn->failed = true;
+    }
+}
+
+// Function that handles a completed send: the kernel is done with any
+// write buffer retired while it was in flight.
+void ring_send_done(Connection* conn, int res) {
+
+    conn->sendArmed = false;
+    conn->opsPending--;
+    free(conn->retiredBuffer);
+    conn->retiredBuffer = NULL;
+    if (res > 0) {
+	conn->writeOffset += res;
+	if (conn->writeOffset == conn->writeLength) {
+	    conn->writeOffset = conn->writeLength = 0;
+	}
+    } else if (res < 0 && res != -EINTR && res != -EAGAIN) {
+	conn->failed = true;
+    }
+}
+
+// Function that handles one completion of the ring thread's io_uring. The
+// operation and the connection it is for (if any) are in its user_data.
+void handle_ring_completion(IoThread* io, struct io_uring_cqe* cqe) {
+
+    RingOp op = cqe->user_data & RING_OP_MASK;
+    Connection* conn = (Connection*)(uintptr_t)(cqe->user_data
+	    & ~(uint64_t)RING_OP_MASK);
+    if (op == RING_ACCEPT) {
+	ring_accept_done(io, cqe->res, cqe->flags);
+	return;
+    } else if (op == RING_WAKE) {
+	arm_ring_wake(io);
+	answer_completed_connections(io);
+	return;
+    }
+    if (conn->closed) {
+	return;
+    }
+    if (op == RING_RECV) {
+	ring_recv_done(conn, cqe->res, cqe->flags);
+    } else if (op == RING_SEND) {
+	ring_send_done(conn, cqe->res);
+    } else if (op == RING_CANCEL) {
+	conn->cancelPending = false;
+	conn->opsPending--;
+    }
+    service_connection(conn);
+}
+#endif
+
+// Function that serves every client from the calling thread through a
+// single io_uring: accepts, recvs and sends for all connections are
+// submitted together, one system call per batch of completions. Takes in
+// the listening socket and the ClientInfo each client gets a copy of.
+// Returns false (straight away) if io_uring is not available, otherwise
+// never returns.
+bool serve_io_ring(int socketFd, ClientInfo* clientInfo) {
+
+#ifdef HAVE_IO_URING
+    IoRing* ring = create_io_ring(socketFd, clientInfo);
+    if (ring == NULL) {
+	return false;
+    }
+    IoThread* io = calloc(1, sizeof(IoThread));
+    io->ring = ring;
+    io->epollFd = -1;
+    io->wakeFd = eventfd(0, EFD_CLOEXEC);
+    if (io->wakeFd < 0) {
+	socket_open_error();
+    }
+    init_lock(&io->queueLock, 1);
+    io->tid = pthread_self();
+    arm_ring_wake(io);
+    while (1) {
+	if (!ring->acceptArmed) {
+	    arm_ring_accept(ring);
+	}
+	submit_io_ring(ring, true);
+	unsigned head = *ring->cqHead;
+	unsigned tail;
+	while (head != (tail = __atomic_load_n(ring->cqTail,
+		__ATOMIC_ACQUIRE))) {
+	    while (head != tail) {
+		handle_ring_completion(io, &ring->cqes[head & ring->cqMask]);
+		head++;
+	    }
+	    __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+	}
+	free_dead_connections(io);
+    }
+#endif
+    return false;
+}
+
+// Function to crack the ciphers of a pass over the candidate range of the
+// given chunk. Takes in the chunk, the calling worker's backend state
+// (already set up for the pass's salt) and the pool. Candidates are hashed
+// a backend batch at a time - the dictionary's slots as they are, with a
+// rule set the batch mangle_batch() builds, or with a mask or for a
+// combinator pass the batch mask_batch() or combine_batch() builds - and
+// each raw result is checked against the set of ciphertexts that were
+// waiting when the chunk was claimed, so only matches are encoded. Each
+// match is answered straight away, then recorded in the potfile. Stops
+// early once the pass has no waiters left. Returns the number of
+// candidates hashed.
+int crack_cipher(CrackTask* task, void* state, WorkerPool* pool) {
+
+    CrackJob* job = task->job;
+    const CryptBackend* backend = pool->backend;
+    uint64_t candidates[CRYPT_MAX_BATCH];
+    uint64_t results[CRYPT_MAX_BATCH];
+    char cipherFromDict[MAX_CIPHER_SIZE + 1];
+    const uint64_t* words;
+    long index = task->startIndex;
+    long covered;
+    int batch;
+    int hashed = 0;
+
+    while (index < task->endIndex) {
+	if (!__atomic_load_n(&job->active, __ATOMIC_ACQUIRE)) {
+	    break;
+	}
+	if (job->rules) {
+	    batch = mangle_batch(job, index, task->endIndex,
+		    backend->batchSize, candidates, &covered);
+	    words = candidates;
+	} else if (job->mask) {
+	    covered = task->endIndex - index < backend->batchSize
+		    ? task->endIndex - index : backend->batchSize;
+	    batch = mask_batch(job->mask, index, covered, candidates);
+	    words = candidates;
+	} else if (job->combine) {
+	    covered = task->endIndex - index < backend->batchSize
+		    ? task->endIndex - index : backend->batchSize;
+	    batch = combine_batch(job->dict->byLength, index, covered,
+		    candidates);
+	    words = candidates;
+	} else {
+	    batch = task->endIndex - index < backend->batchSize
+		    ? task->endIndex - index : backend->batchSize;
+	    covered = batch;
+	    words = job->dict->slots + index;
+	}
+	backend->hash_batch(state, words, batch, results);
+	for (int i = 0; i < batch; i++) {
+	    if (cipher_set_contains(task->cipherSet, results[i])) {
+		encode_crypt_result(job->salt, results[i], cipherFromDict);
+		take_lock(&pool->schedLock);
+		answer_matching_waiters(pool, job, cipherFromDict, words[i]);
+		release_lock(&pool->schedLock);
+		if (pool->potfile) {
+		    record_potfile(pool->potfile, cipherFromDict, words[i]);
+		}
+	    }
+	}
+	index += covered;
+	hashed += batch;
+    }
+    return hashed;
+}
+
+// Function that fills in candidates with up to size candidates of the
+// given pass, from the given position (which must be below its number of
+// candidates) up to end. Rule by rule, each rule is applied to each word
+// in an 8 byte slot, so no mangled word list is ever stored. A candidate
+// that is sure to be tried by another rule anyway - the word as it is,
+// when the rule set has a rule that leaves words alone, or what the
+// previous rule made of the word - is skipped. Sets covered to the number
+// of positions used. Returns the number of candidates filled in.
+int mangle_batch(CrackJob* job, long position, long end, int size,
+	uint64_t* candidates, long* covered) {
+
+    const uint64_t* words = job->dict->slots;
+    int numWords = job->dict->numWords;
+    RuleSet* rules = job->rules;
+    int ruleIndex = position / numWords;
+    int wordIndex = position % numWords;
+    long start = position;
+    int count = 0;
+    while (count < size && position < end) {
+	uint64_t word = words[wordIndex];
+	uint64_t candidate = apply_rule(&rules->rules[ruleIndex], word);
+	if (ruleIndex == rules->identity || !((candidate == word
+		&& rules->identity >= 0) || (ruleIndex > 0 && candidate
+		== apply_rule(&rules->rules[ruleIndex - 1], word)))) {
+	    candidates[count++] = candidate;
+	}
+	position++;
+	if (++wordIndex == numWords) {
+	    wordIndex = 0;
+	    ruleIndex++;
+	}
+    }
+    *covered = position - start;
+    return count;
+}
+
+// Function that fills in candidates with the count words of the given
+// mask's keyspace from the given index on (which must all be below its
+// number of candidates). Only the first index is split into the character
+// of each position, the rest follow by counting up the positions like an
+// odometer, changing just the bytes of the slot that change. Returns the
+// number of candidates filled in.
+int mask_batch(const Mask* mask, long index, int count,
+	uint64_t* candidates) {
+
+    int digits[MAX_PHRASE_SIZE];
+    int partIndex = 0;
+    while (index >= mask->parts[partIndex].numCandidates) {
+	index -= mask->parts[partIndex++].numCandidates;
+    }
+    const MaskPart* part = &mask->parts[partIndex];
+    uint64_t slot = 0;
+    for (int i = 0; i < part->length; i++) {
+	digits[i] = index % part->sizes[i];
+	index /= part->sizes[i];
+	slot |= (uint64_t)(unsigned char)(part->sets[i]
+		? part->sets[i][digits[i]] : part->literals[i]) << (8 * i);
+    }
+    for (int n = 0; n < count; n++) {
+	candidates[n] = slot;
+	int i = 0;
+	while (i < part->length && ++digits[i] == part->sizes[i]) {
+	    digits[i] = 0;
+	    i++;
+	}
+	if (i == part->length) {
+	    // The part is used up, the next starts at its first word
+	    if (++partIndex == mask->numParts) {
+		break;
+	    }
+	    part = &mask->parts[partIndex];
+	    slot = 0;
+	    for (i = 0; i < part->length; i++) {
+		digits[i] = 0;
+		slot |= (uint64_t)(unsigned char)(part->sets[i]
+			? part->sets[i][0] : part->literals[i]) << (8 * i);
+	    }
+	    continue;
+	}
+	// Positions below i wrapped around to their first character, and
+	// literal positions never change
+	for (int j = 0; j <= i; j++) {
+	    if (part->sets[j] == NULL) {
+		continue;
+	    }
+	    slot &= ~(0xffULL << (8 * j));
+	    slot |= (uint64_t)(unsigned char)part->sets[j][digits[j]]
+		    << (8 * j);
+	}
+    }
+    return count;
+}
+
+// Function that fills in candidates with the count pairs of words of the
+// given dictionary's length buckets from the given index on (which must
+// all be below its number of pairs). The pairs are grouped by the first
+// word's length, whose second words are the shortest words that fit, so
+// no pair that is too long is ever made. Each group is split into tiles of
+// COMBINE_TILE_LEFT first words by COMBINE_TILE_RIGHT second words, gone
+// through one after another, so a chunk only touches a few words of each.
+// Only the first index is split up, the rest follow by counting. Returns
+// the number of candidates filled in.
+int combine_batch(const LengthBuckets* buckets, long index, int count,
+	uint64_t* candidates) {
+
+    const uint64_t* slots = buckets->slots;
+    int length = 0;
+    while (index >= buckets->groupPairs[length]) {
+	index -= buckets->groupPairs[length++];
+    }
+    const uint64_t* lefts = slots + buckets->starts[length];
+    int numLeft = buckets->starts[length + 1] - buckets->starts[length];
+    int numRight = buckets->starts[MAX_PHRASE_SIZE + 1 - length];
+    int row = index / ((long)COMBINE_TILE_LEFT * numRight)
+	    * COMBINE_TILE_LEFT;
+    index %= (long)COMBINE_TILE_LEFT * numRight;
+    int height = numLeft - row < COMBINE_TILE_LEFT ? numLeft - row
+	    : COMBINE_TILE_LEFT;
+    int col = index / (height * COMBINE_TILE_RIGHT) * COMBINE_TILE_RIGHT;
+    index %= height * COMBINE_TILE_RIGHT;
+    int width = numRight - col < COMBINE_TILE_RIGHT ? numRight - col
+	    : COMBINE_TILE_RIGHT;
+    int left = row + index / width;
+    int right = col + index % width;
+    for (int n = 0; n < count; n++) {
+	// A first word of MAX_PHRASE_SIZE characters only goes with the
+	// empty word
+	candidates[n] = length < MAX_PHRASE_SIZE
+		? lefts[left] | slots[right] << (8 * length) : lefts[left];
+	if (++right < col + width) {
+	    continue;
+	}
+	right = col;
+	if (++left < row + height) {
+	    continue;
+	}
+	// The tile is done, move on to the next in its row of tiles, or
+	// the next row, or the next group
+	col += COMBINE_TILE_RIGHT;
+	if (col >= numRight) {
+	    col = 0;
+	    row += COMBINE_TILE_LEFT;
+	    while (row >= numLeft) {
+		if (++length > MAX_PHRASE_SIZE) {
+		    return count;
+		}
+		lefts = slots + buckets->starts[length];
+		numLeft = buckets->starts[length + 1]
+			- buckets->starts[length];
+		numRight = buckets->starts[MAX_PHRASE_SIZE + 1 - length];
+		row = numRight > 0 ? 0 : numLeft;
+	    }
+	    height = numLeft - row < COMBINE_TILE_LEFT ? numLeft - row
+		    : COMBINE_TILE_LEFT;
+	}
+	width = numRight - col < COMBINE_TILE_RIGHT ? numRight - col
+		: COMBINE_TILE_RIGHT;
+	left = row;
+	right = col;
+    }
+    return count;
+}
+
+// Function that returns a mask with bit 7 set in every byte of the given
+// slot that is within the given range of ASCII characters.
+uint64_t slot_char_range(uint64_t slot, int low, int high) {
+
+    uint64_t low7 = slot & SLOT_LOW_BITS;
+    uint64_t atLeast = low7 + (0x80 - low) * SLOT_ONES;
+    uint64_t above = low7 + (0x7f - high) * SLOT_ONES;
+    return atLeast & ~above & ~slot & SLOT_HIGH_BITS;
+}
+
+// Function that returns the length of the word in the given slot, whose
+// last character is its highest non zero byte.
+int slot_length(uint64_t slot) {
+
+    return slot ? MAX_PHRASE_SIZE - __builtin_clzll(slot) / 8 : 0;
+}
+
+// Function that returns the given word (as its dictionary slot) mangled by
+// the given rule. The slot holds the word's first character in its lowest
+// byte (pack_word() copies the word into it on a little endian machine),
+// and every operation works on the slot as a whole, a byte at a time in
+// parallel, so the candidate never leaves a register. A word pushed past
+// MAX_PHRASE_SIZE characters loses its last characters, as crypt(3) would
+// ignore them.
+uint64_t apply_rule(const Rule* rule, uint64_t slot) {
+
+    int length;
+    uint64_t match;
+    for (int i = 0; i < rule->numOps; i++) {
+	const RuleOp* op = &rule->ops[i];
+	switch (op->command) {
+	    // Case changes flip the 0x20 bit of ASCII letters
+	    case 'l':
+		slot |= slot_char_range(slot, 'A', 'Z') >> 2;
+		break;
+	    case 'c':
+		slot |= slot_char_range(slot, 'A', 'Z') >> 2;
+		slot ^= slot_char_range(slot, 'a', 'z') >> 2 & 0xff;
+		break;
+	    case 'u':
+		slot ^= slot_char_range(slot, 'a', 'z') >> 2;
+		break;
+	    case 't':
+		slot ^= (slot_char_range(slot, 'A', 'Z')
+			| slot_char_range(slot, 'a', 'z')) >> 2;
+		break;
+	    case 'T':
+		if (op->arg1 < MAX_PHRASE_SIZE) {
+		    slot ^= (slot_char_range(slot, 'A', 'Z')
+			    | slot_char_range(slot, 'a', 'z')) >> 2
+			    & (0xffULL << (8 * op->arg1));
+		}
+		break;
+	    case 'r':
+		length = slot_length(slot);
+		if (length > 0) {
+		    slot = __builtin_bswap64(slot)
+			    >> (8 * (MAX_PHRASE_SIZE - length));
+		}
+		break;
+	    case '$':
+		length = slot_length(slot);
+		if (length < MAX_PHRASE_SIZE) {
+		    slot |= (uint64_t)op->arg1 << (8 * length);
+		}
+		break;
+	    case '^':
+		slot = (slot << 8) | op->arg1;
+		break;
+	    case 's':
+		// Bytes equal to arg1 are the zero bytes of the xor
+		match = slot ^ (op->arg1 * SLOT_ONES);
+		match = ~(((match & SLOT_LOW_BITS) + SLOT_LOW_BITS) | match
+			| SLOT_LOW_BITS);
+		match = (match >> 7) * 0xff;
+		slot = (slot & ~match) | (op->arg2 * SLOT_ONES & match);
+		break;
+	    case '\'':
+		if (op->arg1 < MAX_PHRASE_SIZE) {
+		    slot &= (1ULL << (8 * op->arg1)) - 1;
+		}
+		break;
+	}
+    }
+    return slot;
+}
+
+// Function that returns the number of online processors, which is the most
+// crack workers the pool will run.
+int core_count(void) {
+
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (count < 1) {
+	return 1;
+    }
+    return (int)count;
+}
+
+// Function that creates the pool of crack workers. Takes in the number of
+// workers to start, the statistics the workers update, the crypt backend
+// they hash with and the potfile of past cracks (NULL for none). A chunk
+// is CRACK_CHUNK_BATCHES of the backend's batches, so it is always hashed
+// in full batches, and its slots (16KB at most) stay in the L1 cache.
+// Returns the new pool.
+WorkerPool* create_worker_pool(int numWorkers, Statistics* stats,
+	DictionarySet* dictionaries, RuleSet* ruleSets, int numRuleSets,
+	const CryptBackend* backend, Potfile* potfile) {
+
+    WorkerPool* pool = malloc(sizeof(WorkerPool));
+    memset(pool, 0, sizeof(WorkerPool));
+    pool->numWorkers = numWorkers;
+    pool->tids = malloc(sizeof(pthread_t) * numWorkers);
+    pool->stats = stats;
+    pool->dictionaries = dictionaries;
+    pool->ruleSets = ruleSets;
+    pool->numRuleSets = numRuleSets;
+    init_lock(&pool->schedLock, 1);
+    init_lock(&pool->workAvailable, 0);
+    pool->cache = create_crack_cache();
+    pool->potfile = potfile;
+    pool->backend = backend;
+    pool->chunkSize = backend->batchSize * CRACK_CHUNK_BATCHES;
+    // A crypt request hashes a single word, which would cost a bitsliced
+    // backend a whole batch
+    pool->cryptBackend = backend->kernel ? select_crypt_backend("des")
+	    : backend;
+    for (int i = 0; i < numWorkers; i++) {
+	pthread_create(&(pool->tids[i]), NULL, crack_worker, pool);
+	pthread_detach(pool->tids[i]);
+    }
+    return pool;
+}
+
+// Function that returns the position of a salt among the SALT_COMBINATIONS
+// possible salts. The salt's characters must be from CHAR_SET.
+int salt_index(char* salt) {
+
+    int first = strchr(CHAR_SET, salt[0]) - CHAR_SET;
+    int second = strchr(CHAR_SET, salt[1]) - CHAR_SET;
+    return first * (sizeof(CHAR_SET) - 1) + second;
+}
+
+// Function that hashes a raw crypt(3) result for the cipher set. The result
+// is already well mixed, so its top bits are used as they are.
+unsigned int cipher_hash(uint64_t result) {
+
+    return (unsigned int)(result >> 32);
+}
+
+// Function that builds the set of ciphertexts of the given list of waiters.
+// A ciphertext that no traditional crypt(3) result encodes to is left out
+// as no word can match it. Returns the new set with a single reference held
+// by the caller.
+CipherSet* build_cipher_set(CrackWaiter* waiters) {
+
+    int count = 0;
+    int capacity = 8;
+    uint64_t result;
+    for (CrackWaiter* w = waiters; w; w = w->next) {
+	count++;
+    }
+    while (capacity < count * 2) {
+	capacity *= 2;
+    }
+    CipherSet* set = malloc(sizeof(CipherSet));
+    set->refs = 1;
+    set->mask = capacity - 1;
+    set->slots = calloc(capacity, sizeof(uint64_t));
+    set->used = calloc(capacity, sizeof(bool));
+    for (CrackWaiter* w = waiters; w; w = w->next) {
+	if (!decode_crypt_result(w->cipherText, &result)) {
+	    continue;
+	}
+	unsigned int slot = cipher_hash(result) & set->mask;
+	while (set->used[slot] && set->slots[slot] != result) {
+	    slot = (slot + 1) & set->mask;
+	}
+	set->slots[slot] = result;
+	set->used[slot] = true;
+    }
+    return set;
+}
+
+// Function that drops a reference to the given set, freeing it once it has
+// none left. Must be called with the pool's schedLock held.
+void release_cipher_set(CipherSet* set) {
+
+    if (--set->refs == 0) {
+	free(set->slots);
+	free(set->used);
+	free(set);
+    }
+}
+
+// Function that returns true if the given raw crypt(3) result is in the
+// set. The set is never modified once built so no lock is required.
+bool cipher_set_contains(CipherSet* set, uint64_t result) {
+
+    unsigned int slot = cipher_hash(result) & set->mask;
+    while (set->used[slot]) {
+	if (set->slots[slot] == result) {
+	    return true;
+	}
+	slot = (slot + 1) & set->mask;
+    }
+    return false;
+}
+
+// Function that replaces the cipher set of a pass after its waiters have
+// changed. Workers holding the old set keep using it until their chunk is
+// done. Must be called with the pool's schedLock held.
+void rebuild_cipher_set(CrackJob* job) {
+
+    if (job->cipherSet) {
+	release_cipher_set(job->cipherSet);
+    }
+    job->cipherSet = build_cipher_set(job->waiters);
+}
+
+// Function that creates an empty crack cache.
+CrackCache* create_crack_cache(void) {
+
+    CrackCache* cache = malloc(sizeof(CrackCache));
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+	CacheShard* shard = &cache->shards[i];
+	init_lock(&shard->lock, 1);
+	shard->numEntries = 0;
+	shard->newest = shard->oldest = -1;
+	memset(shard->buckets, -1, sizeof(shard->buckets));
+    }
+    return cache;
+}
+
+// Function that returns the scope of a crack request: a value that is the
+// same for two requests exactly when they try the same candidates - the
+// same dictionary load (by generation), rule set and mode, or the same
+// mask. A request that found nothing is only answered from the cache for
+// the same scope, so a new dictionary load invalidates it.
+uint64_t crack_scope(Dictionary* dict, RuleSet* rules, Mask* mask,
+	bool combine) {
+
+    uint64_t scope = 0;
+    if (mask) {
+	for (const char* c = mask->text; *c; c++) {
+	    scope = (scope ^ (unsigned char)*c) * 0x100000001b3ULL;
+	}
+	return word_key_hash(scope) | 1;
+    }
+    scope = word_key_hash((uint64_t)dict->generation * 2 + combine);
+    return word_key_hash(scope ^ (uintptr_t)rules) & ~1ULL;
+}
+
+// Function that returns the cache shard holding the given ciphertext, and
+// sets bucket to its hash bucket there.
+CacheShard* cache_shard(CrackCache* cache, const char* cipherText,
+	int* bucket) {
+
+    uint64_t hash = 0;
+    for (int i = 0; i < MAX_CIPHER_SIZE && cipherText[i]; i++) {
+	hash = (hash ^ (unsigned char)cipherText[i]) * 0x100000001b3ULL;
+    }
+    hash = word_key_hash(hash);
+    *bucket = (hash >> 32) & (CACHE_SHARD_BUCKETS - 1);
+    return &cache->shards[hash % CACHE_SHARDS];
+}
+
+// Function that returns the index of the entry for the given ciphertext in
+// the given bucket of a cache shard, or -1 if there is none. Must be
+// called with the shard's lock held.
+int find_cache_entry(CacheShard* shard, int bucket, const char* cipherText) {
+
+    int index = shard->buckets[bucket];
+    while (index >= 0 && strncmp(shard->entries[index].cipherText,
+	    cipherText, MAX_CIPHER_SIZE) != 0) {
+	index = shard->entries[index].chain;
+    }
+    return index;
+}
+
+// Function that takes a cache entry out of its shard's list of entries by
+// use. Must be called with the shard's lock held.
+void unlink_cache_entry(CacheShard* shard, int index) {
+
+    CacheEntry* entry = &shard->entries[index];
+    if (entry->prev >= 0) {
+	shard->entries[entry->prev].next = entry->next;
+    } else {
+	shard->newest = entry->next;
+    }
+    if (entry->next >= 0) {
+	shard->entries[entry->next].prev = entry->prev;
+    } else {
+	shard->oldest = entry->prev;
+    }
+}
+
+// Function that puts a cache entry at the front of its shard's list of
+// entries by use, as the most recently used. Must be called with the
+// shard's lock held.
+void push_cache_entry(CacheShard* shard, int index) {
+
+    CacheEntry* entry = &shard->entries[index];
+    entry->prev = -1;
+    entry->next = shard->newest;
+    if (shard->newest >= 0) {
+	shard->entries[shard->newest].prev = index;
+    } else {
+	shard->oldest = index;
+    }
+    shard->newest = index;
+}
+
+// Function that answers the given crack request from the pool's cache if
+// it can - if its ciphertext's word was found, or nothing was found for it
+// in the given scope - setting found and result. Counts a cache hit or
+// miss. Returns true if the request was answered.
+bool lookup_crack_cache(WorkerPool* pool, CrackWaiter* waiter,
+	uint64_t scope) {
+
+    int bucket;
+    CacheShard* shard = cache_shard(pool->cache, waiter->cipherText,
+	    &bucket);
+    bool answered = false;
+    take_lock(&shard->lock);
+    int index = find_cache_entry(shard, bucket, waiter->cipherText);
+    if (index >= 0 && (shard->entries[index].found
+	    || shard->entries[index].scope == scope)) {
+	CacheEntry* entry = &shard->entries[index];
+	waiter->found = entry->found;
+	strcpy(waiter->result, entry->result);
+	unlink_cache_entry(shard, index);
+	push_cache_entry(shard, index);
+	answered = true;
+    }
+    release_lock(&shard->lock);
+    add_statistic(answered ? &stats_shard(pool->stats)->cacheHits
+	    : &stats_shard(pool->stats)->cacheMisses, 1);
+    return answered;
+}
+
+// Function that caches the answer to the given crack request, which went
+// through every candidate of the given scope. A found word replaces
+// anything cached for the ciphertext, but nothing found never replaces a
+// found word. If the shard is full its least recently used entry is
+// evicted.
+void store_crack_cache(WorkerPool* pool, CrackWaiter* waiter,
+	uint64_t scope) {
+
+    int bucket;
+    CacheShard* shard = cache_shard(pool->cache, waiter->cipherText,
+	    &bucket);
+    bool evicted = false;
+    take_lock(&shard->lock);
+    int index = find_cache_entry(shard, bucket, waiter->cipherText);
+    bool fresh = index < 0;
+    if (index >= 0) {
+	unlink_cache_entry(shard, index);
+    } else if (shard->numEntries < CACHE_SHARD_ENTRIES) {
+	index = shard->numEntries++;
+    } else {
+	// Reuse the oldest entry, taking it out of its hash bucket
+	index = shard->oldest;
+	unlink_cache_entry(shard, index);
+	int oldBucket;
+	cache_shard(pool->cache, shard->entries[index].cipherText,
+		&oldBucket);
+	int* link = &shard->buckets[oldBucket];
+	while (*link != index) {
+	    link = &shard->entries[*link].chain;
+	}
+	*link = shard->entries[index].chain;
+	evicted = true;
+    }
+    CacheEntry* entry = &shard->entries[index];
+    if (fresh) {
+	strncpy(entry->cipherText, waiter->cipherText, MAX_CIPHER_SIZE);
+	entry->cipherText[MAX_CIPHER_SIZE] = '\0';
+	entry->found = false;
+	entry->chain = shard->buckets[bucket];
+	shard->buckets[bucket] = index;
+    }
+    if (waiter->found) {
+	entry->found = true;
+	strcpy(entry->result, waiter->result);
+    } else if (!entry->found) {
+	entry->result[0] = '\0';
+	entry->scope = scope;
+    }
+    push_cache_entry(shard, index);
+    release_lock(&shard->lock);
+    if (evicted) {
+	add_statistic(&stats_shard(pool->stats)->cacheEvictions, 1);
+    }
+}
+
+// Function that finds the index key of a traditional crypt(3) ciphertext:
+// its salt (as the salt's 12 bits plus one, so no key has a salt of 0) and
+// raw result. Returns false if no traditional crypt(3) result has that
+// text.
+bool potfile_key(const char* cipherText, uint32_t* salt, uint64_t* result) {
+
+    int first = crypt_char_value(cipherText[0]);
+    int second = crypt_char_value(cipherText[1]);
+    if (first < 0 || second < 0 || strlen(cipherText) != MAX_CIPHER_SIZE
+	    || !decode_crypt_result(cipherText, result)) {
+	return false;
+    }
+    *salt = (first | second << 6) + 1;
+    return true;
+}
+
+// Function that returns the entry of the potfile's index for the given
+// salt and raw result, or the empty entry where it would go. Must be
+// called with the potfile's lock held.
+PotEntry* find_pot_entry(Potfile* pot, uint32_t salt, uint64_t result) {
+
+    long slot = word_key_hash(result ^ (uint64_t)salt << 48)
+	    & (pot->capacity - 1);
+    while (pot->entries[slot].salt != 0 && (pot->entries[slot].salt != salt
+	    || pot->entries[slot].result != result)) {
+	slot = (slot + 1) & (pot->capacity - 1);
+    }
+    return &pot->entries[slot];
+}
+
+// Function that doubles the size of the potfile's index (or gives it
+// POTFILE_MIN_ENTRIES entries if it has none). A mapped index file is let
+// go of once its entries are moved. Must be called with the potfile's
+// lock held.
+void grow_pot_index(Potfile* pot) {
+
+    PotEntry* old = pot->entries;
+    long oldCapacity = pot->capacity;
+    pot->capacity = oldCapacity ? oldCapacity * 2 : POTFILE_MIN_ENTRIES;
+    pot->entries = calloc(pot->capacity, sizeof(PotEntry));
+    for (long i = 0; i < oldCapacity; i++) {
+	if (old[i].salt != 0) {
+	    *find_pot_entry(pot, old[i].salt, old[i].result) = old[i];
+	}
+    }
+    if (pot->mapping) {
+	munmap(pot->mapping, pot->mappingSize);
+	pot->mapping = NULL;
+    } else {
+	free(old);
+    }
+}
+
+// Function that adds the given word for the given salt and raw result to
+// the potfile's index, growing it first if it would be over half full.
+// Must be called with the potfile's lock held. Returns false if the index
+// already has the salt and result.
+bool add_pot_entry(Potfile* pot, uint32_t salt, uint64_t result,
+	uint64_t word) {
+
+    if ((pot->numEntries + 1) * 2 > pot->capacity) {
+	grow_pot_index(pot);
+    }
+    PotEntry* entry = find_pot_entry(pot, salt, result);
+    if (entry->salt != 0) {
+	return false;
+    }
+    entry->salt = salt;
+    entry->result = result;
+    entry->word = word;
+    pot->numEntries++;
+    return true;
+}
+
+// Function that adds every record in the given potfile lines to the
+// potfile's index - lines that are not "ciphertext:word", with a
+// traditional crypt(3) ciphertext and a word of at most MAX_PHRASE_SIZE
+// characters, and records the index already has are skipped. A last line
+// without a newline is only read if endsLine is set, as in a potfile it is
+// a record cut short by a crash. If added is not NULL the records added
+// are copied to it (with room for size + 1 characters) and addedSize set
+// to their length. Returns the length of the lines read.
+size_t index_pot_records(Potfile* pot, const char* data, size_t size,
+	bool endsLine, char* added, size_t* addedSize) {
+
+    char cipherText[MAX_CIPHER_SIZE + 1];
+    const char* line = data;
+    const char* end = data + size;
+    uint32_t salt;
+    uint64_t result;
+    if (added) {
+	*addedSize = 0;
+    }
+    while (line < end) {
+	const char* newline = memchr(line, '\n', end - line);
+	if (newline == NULL && !endsLine) {
+	    break;
+	}
+	const char* lineEnd = newline ? newline : end;
+	const char* word = line + MAX_CIPHER_SIZE + 1;
+	if (word <= lineEnd && lineEnd - word <= MAX_PHRASE_SIZE
+		&& line[MAX_CIPHER_SIZE] == ':'
+		&& !memchr(line, '\0', lineEnd - line)) {
+	    memcpy(cipherText, line, MAX_CIPHER_SIZE);
+	    cipherText[MAX_CIPHER_SIZE] = '\0';
+	    if (potfile_key(cipherText, &salt, &result) && add_pot_entry(pot,
+		    salt, result, pack_word(word, lineEnd - word)) && added) {
+		memcpy(added + *addedSize, line, lineEnd - line);
+		*addedSize += lineEnd - line;
+		added[(*addedSize)++] = '\n';
+	    }
+	}
+	line = newline ? newline + 1 : end;
+    }
+    return line - data;
+}
+
+// Function that returns the checksum of the (up to POTFILE_CHECK_SIZE)
+// bytes of a potfile before the given length, read from the given
+// descriptor, which ties an index file to the potfile it was made from.
+uint64_t potfile_tail_checksum(int fd, size_t length) {
+
+    char tail[POTFILE_CHECK_SIZE];
+    size_t count = length < POTFILE_CHECK_SIZE ? length : POTFILE_CHECK_SIZE;
+    if (pread(fd, tail, count, length - count) != count) {
+	return 0;
+    }
+    return snapshot_checksum(tail, count, 0xcbf29ce484222325ULL);
+}
+
+// Function that uses the potfile's index file as its index if it was made
+// from the potfile open on the given descriptor, of the given size. The
+// file is mapped privately, so entries added later are never written back.
+// Returns the length of the potfile the index has every record of (0 if
+// the index file is missing, corrupt or of some other potfile).
+size_t load_pot_index(Potfile* pot, int fd, size_t size) {
+
+    struct stat info;
+    int indexFd = open(pot->indexName, O_RDONLY);
+    if (indexFd < 0) {
+	return 0;
+    }
+    if (fstat(indexFd, &info) != 0
+	    || info.st_size < sizeof(PotIndexHeader)) {
+	close(indexFd);
+	return 0;
+    }
+    char* data = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE, indexFd, 0);
+    close(indexFd);
+    if (data == MAP_FAILED) {
+	return 0;
+    }
+    PotIndexHeader* header = (PotIndexHeader*)data;
+    PotEntry* entries = (PotEntry*)(data + sizeof(PotIndexHeader));
+    if (memcmp(header->magic, POTFILE_INDEX_MAGIC, 8) != 0
+	    || header->version != POTFILE_INDEX_VERSION
+	    || header->capacity < POTFILE_MIN_ENTRIES
+	    || (header->capacity & (header->capacity - 1))
+	    || (uint64_t)header->numEntries * 2 > header->capacity
+	    // Checked before multiplying so a huge capacity cannot overflow
+	    || header->capacity > (info.st_size - sizeof(PotIndexHeader))
+	    / sizeof(PotEntry)
+	    || info.st_size != sizeof(PotIndexHeader)
+	    + sizeof(PotEntry) * header->capacity
+	    || header->covered > size || header->tailChecksum
+	    != potfile_tail_checksum(fd, header->covered)
+	    || header->checksum != snapshot_checksum(entries,
+	    sizeof(PotEntry) * header->capacity, 0xcbf29ce484222325ULL)) {
+	munmap(data, info.st_size);
+	return 0;
+    }
+    pot->mapping = data;
+    pot->mappingSize = info.st_size;
+    pot->entries = entries;
+    pot->capacity = header->capacity;
+    pot->numEntries = header->numEntries;
+    return header->covered;
+}
+
+// Function that writes the potfile's index to its index file, as having
+// every record of the potfile's first covered bytes. Like a snapshot it
+// is written to a temporary file renamed over the old one. An index file
+// that cannot be written only makes the next start slower, so a failure
+// is ignored.
+void write_pot_index(Potfile* pot) {
+
+    PotIndexHeader header;
+    memset(&header, 0, sizeof(PotIndexHeader));
+    memcpy(header.magic, POTFILE_INDEX_MAGIC, 8);
+    header.version = POTFILE_INDEX_VERSION;
+    header.numEntries = pot->numEntries;
+    header.capacity = pot->capacity;
+    header.covered = pot->covered;
+    int fd = open(pot->fileName, O_RDONLY);
+    if (fd < 0) {
+	return;
+    }
+    header.tailChecksum = potfile_tail_checksum(fd, pot->covered);
+    close(fd);
+    header.checksum = snapshot_checksum(pot->entries,
+	    sizeof(PotEntry) * pot->capacity, 0xcbf29ce484222325ULL);
+    char* tempName = malloc(strlen(pot->indexName) + 5);
+    sprintf(tempName, "%s.tmp", pot->indexName);
+    FILE* out = fopen(tempName, "w");
+    if (out) {
+	fwrite(&header, sizeof(PotIndexHeader), 1, out);
+	fwrite(pot->entries, sizeof(PotEntry), pot->capacity, out);
+	if (ferror(out) | fclose(out) || rename(tempName, pot->indexName)) {
+	    unlink(tempName);
+	}
+    }
+    free(tempName);
+}
+
+// Function that opens the potfile with the given name, creating it if
+// there is none, and builds its index. The index file (the potfile's name
+// with ".idx" added) is used if it was made from this potfile, so only
+// the records appended since it was written are parsed, and is written
+// again if any were. A record cut short by a crash is cut off the potfile.
+// Prints the potfile error message and exits if it cannot be opened.
+Potfile* open_potfile(char* fileName) {
+
+    Potfile* pot = malloc(sizeof(Potfile));
+    memset(pot, 0, sizeof(Potfile));
+    pot->fileName = fileName;
+    pot->indexName = malloc(strlen(fileName) + 5);
+    sprintf(pot->indexName, "%s.idx", fileName);
+    init_lock(&pot->lock, 1);
+    init_lock(&pot->writeLock, 1);
+    pot->fd = open(fileName, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    int fd = open(fileName, O_RDONLY);
+    if (pot->fd < 0 || fd < 0) {
+	potfile_error(fileName);
+    }
+    size_t size;
+    bool mapped;
+    struct stat info;
+    size_t covered = fstat(fd, &info) == 0
+	    ? load_pot_index(pot, fd, info.st_size) : 0;
+    if (pot->entries == NULL) {
+	grow_pot_index(pot);
+    }
+    char* data = map_dictionary_file(fd, &size, &mapped);
+    pot->covered = covered;
+    if (covered < size) {
+	pot->covered += index_pot_records(pot, data + covered,
+		size - covered, false, NULL, NULL);
+    }
+    if (pot->covered < size && ftruncate(pot->fd, pot->covered) != 0) {
+	potfile_error(fileName);
+    }
+    if (pot->covered != covered || pot->mapping == NULL) {
+	write_pot_index(pot);
+    }
+    if (mapped) {
+	munmap(data, size);
+    } else {
+	free(data);
+    }
+    return pot;
+}
+
+// Function that runs the --import-potfile mode. Adds every record of the
+// potfile with the given name (such as one another cracker wrote) that the
+// potfile does not have yet, appending them all with a single write, and
+// updates the index file. Prints the number of records imported. Prints
+// the potfile error message and exits if either file cannot be used.
+void import_potfile(Potfile* pot, char* fileName) {
+
+    struct stat info;
+    size_t size;
+    size_t addedSize;
+    bool mapped;
+    int fd = open(fileName, O_RDONLY);
+    if (fd < 0) {
+	potfile_error(fileName);
+    }
+    char* data = map_dictionary_file(fd, &size, &mapped);
+    char* added = malloc(size + 1);
+    long before = pot->numEntries;
+    index_pot_records(pot, data, size, true, added, &addedSize);
+    if (addedSize > 0 && write(pot->fd, added, addedSize) != addedSize) {
+	potfile_error(pot->fileName);
+    }
+    // Only index the records if nothing else appended to the potfile
+    if (fstat(pot->fd, &info) == 0
+	    && info.st_size == pot->covered + addedSize) {
+	pot->covered += addedSize;
+	write_pot_index(pot);
+    }
+    printf("%li potfile records imported\n", pot->numEntries - before);
+    fflush(stdout);
+    free(added);
+    if (mapped) {
+	munmap(data, size);
+    } else {
+	free(data);
+    }
+}
+
+// Function that answers the given crack request from the pool's potfile
+// if its ciphertext was ever cracked, setting found and result. Returns
+// true if the request was answered.
+bool lookup_potfile(WorkerPool* pool, CrackWaiter* waiter) {
+
+    Potfile* pot = pool->potfile;
+    uint32_t salt;
+    uint64_t result;
+    if (pot == NULL || !potfile_key(waiter->cipherText, &salt, &result)) {
+	return false;
+    }
+    take_lock(&pot->lock);
+    PotEntry* entry = find_pot_entry(pot, salt, result);
+    bool found = entry->salt != 0;
+    if (found) {
+	unpack_word(entry->word, waiter->result);
+	waiter->found = true;
+    }
+    release_lock(&pot->lock);
+    return found;
+}
+
+// Function that adds a cracked ciphertext and the word (as a slot) that
+// gives it to the potfile, unless it already has it. The record is
+// appended with a single write and synced to disk before it is indexed,
+// and a record only partly written is cut off again, so a later record is
+// never joined onto it. Only writeLock is held while writing, the index's
+// lock just while checking for and adding the entry - only appends add
+// entries, so the check still holds once the record is written.
+void record_potfile(Potfile* pot, const char* cipherText, uint64_t word) {
+
+    char line[MAX_CIPHER_SIZE + MAX_PHRASE_SIZE + 3];
+    char plainText[MAX_PHRASE_SIZE + 1];
+    uint32_t salt;
+    uint64_t result;
+    if (!potfile_key(cipherText, &salt, &result)) {
+	return;
+    }
+    take_lock(&pot->writeLock);
+    take_lock(&pot->lock);
+    bool known = find_pot_entry(pot, salt, result)->salt != 0;
+    release_lock(&pot->lock);
+    if (!known) {
+	unpack_word(word, plainText);
+	int length = sprintf(line, "%s:%s\n", cipherText, plainText);
+	off_t end = lseek(pot->fd, 0, SEEK_END);
+	if (end >= 0 && write(pot->fd, line, length) == length) {
+	    fdatasync(pot->fd);
+	    take_lock(&pot->lock);
+	    add_pot_entry(pot, salt, result, word);
+	    release_lock(&pot->lock);
+	} else {
+	    fprintf(stderr, "crackserver: unable to write potfile \"%s\"\n",
+		    pot->fileName);
+	    // Cut off whatever part of the record was written
+	    if (end < 0 || ftruncate(pot->fd, end) != 0) {
+		fprintf(stderr, "crackserver: unable to repair potfile "
+			"\"%s\"\n", pot->fileName);
+	    }
+	}
+    }
+    release_lock(&pot->writeLock);
+}
+
+// Function that adds a pass to the pool's ring of runnable passes. Must be
+// called with the pool's schedLock held.
+void link_crack_job(WorkerPool* pool, CrackJob* job) {
+
+    job->runnable = true;
+    job->credit = job->weight;
+    if (pool->current) {
+	// Insert just behind the current pass so it runs after a full turn
+	job->next = pool->current;
+	job->prev = pool->current->prev;
+	job->prev->next = job;
+	job->next->prev = job;
+    } else {
+	job->next = job->prev = job;
+	pool->current = job;
+    }
+}
+
+// Function that removes the given pass from the pool's ring of runnable
+// passes. Must be called with the pool's schedLock held.
+void unlink_crack_job(WorkerPool* pool, CrackJob* job) {
+
+    if (!job->runnable) {
+	return;
+    }
+    job->runnable = false;
+    if (job->next == job) {
+	pool->current = NULL;
+    } else {
+	job->prev->next = job->next;
+	job->next->prev = job->prev;
+	if (pool->current == job) {
+	    pool->current = job->next;
+	}
+    }
+}
+
+// Function that returns the pass over the given dictionary and rule set,
+// or its pairs of words if combine is set (or, with no dictionary, over
+// the given mask's keyspace) for the given salt, creating it (with its own
+// reference to the dictionary, or its own copy of the mask) if no request
+// with that salt is pending on the same candidates. The dictionary's
+// length buckets must already be built for a combinator pass. Must be
+// called with the pool's schedLock held.
+CrackJob* find_crack_job(WorkerPool* pool, Dictionary* dict,
+	RuleSet* rules, Mask* mask, bool combine, char* salt) {
+
+    int index = salt_index(salt);
+    CrackJob* job;
+    for (job = pool->passes[index]; job; job = job->sameSalt) {
+	if (job->dict == dict && job->rules == rules
+		&& job->combine == combine && (mask == NULL
+		? job->mask == NULL
+		: job->mask && !strcmp(job->mask->text, mask->text))) {
+	    return job;
+	}
+    }
+    job = malloc(sizeof(CrackJob));
+    memset(job, 0, sizeof(CrackJob));
+    retrieve_salt(salt, job->salt);
+    job->saltIndex = index;
+    job->dict = dict;
+    job->rules = rules;
+    job->combine = combine;
+    job->scope = crack_scope(dict, rules, mask, combine);
+    if (mask) {
+	job->mask = malloc(sizeof(Mask));
+	memcpy(job->mask, mask, sizeof(Mask));
+	job->numCandidates = mask->numCandidates;
+    } else {
+	__atomic_add_fetch(&dict->refs, 1, __ATOMIC_RELAXED);
+	job->numCandidates = combine ? dict->byLength->numPairs
+		: dict->numWords;
+    }
+    if (rules) {
+	job->numCandidates *= rules->numRules;
+    }
+    job->active = true;
+    job->sameSalt = pool->passes[index];
+    pool->passes[index] = job;
+    return job;
+}
+
+// Function that frees a pass once nothing refers to it any more, dropping
+// its reference to its dictionary (or freeing its mask). Must be called
+// with the pool's schedLock held.
+void retire_crack_job(WorkerPool* pool, CrackJob* job) {
+
+    if (job->waiters || job->runnable || job->chunksOutstanding > 0) {
+	return;
+    }
+    CrackJob** link = &pool->passes[job->saltIndex];
+    while (*link != job) {
+	link = &(*link)->sameSalt;
+    }
+    *link = job->sameSalt;
+    release_cipher_set(job->cipherSet);
+    if (job->mask) {
+	free(job->mask);
+    } else {
+	release_dictionary(job->dict);
+    }
+    free(job);
+}
+
+// Function that adds a client's crack request to the pass for its salt over
+// the current dictionary of the given source, mangled by the given rule set
+// (NULL for the words as they are), or if mask is not NULL to the pass for
+// its salt over the mask's keyspace. If combine is set the pass is over
+// pairs of the dictionary's words instead. A request the potfile, the
+// dictionary's precomputed tables (for words as they are) or the cache can
+// answer, or whose dictionary has no pair that fits, is answered straight
+// away. A request for a ciphertext the pass already has a waiter for
+// shares that waiter's window, so it is answered with it and the pass does
+// no more work. Otherwise the request must see every candidate once, so it
+// waits for the numCandidates positions from the pass's current position
+// onwards (wrapping around the candidates). Wakes as many idle workers as
+// the request adds chunks.
+void submit_crack_request(ClientInfo* clientInfo, CrackWaiter* waiter,
+	DictionarySource* source, RuleSet* rules, Mask* mask, bool combine) {
+
+    WorkerPool* pool = clientInfo->pool;
+    if (lookup_potfile(pool, waiter)) {
+	answer_crack_request(pool, waiter);
+	return;
+    }
+    Dictionary* dict = mask ? NULL : acquire_dictionary(source);
+    int wake;
+    if ((!rules && !mask && !combine && lookup_crack_tables(clientInfo,
+	    waiter, dict)) || lookup_crack_cache(pool, waiter,
+	    crack_scope(dict, rules, mask, combine)) || (combine
+	    && length_buckets(dict)->numPairs == 0)) {
+	if (dict) {
+	    release_dictionary(dict);
+	}
+	answer_crack_request(pool, waiter);
+	return;
+    }
+    take_lock(&pool->schedLock);
+    CrackJob* job = find_crack_job(pool, dict, rules, mask, combine,
+	    waiter->cipherText);
+    long numCandidates = job->numCandidates;
+    long numChunks = (numCandidates + pool->chunkSize - 1)
+	    / pool->chunkSize;
+    CrackWaiter* leader = job->waiters;
+    while (leader && strcmp(leader->cipherText, waiter->cipherText) != 0) {
+	leader = leader->next;
+    }
+    __atomic_store_n(&job->active, true, __ATOMIC_RELEASE);
+    waiter->job = job;
+    waiter->cancelled = false;
+    waiter->joinPosition = leader ? leader->joinPosition : job->nextPosition;
+    waiter->remaining = leader ? leader->remaining : numCandidates;
+    waiter->next = job->waiters;
+    job->waiters = waiter;
+    job->weight += waiter->weight;
+    wake = 0;
+    if (leader == NULL) {
+	rebuild_cipher_set(job);
+	if (job->endPosition < job->nextPosition + numCandidates) {
+	    job->endPosition = job->nextPosition + numCandidates;
+	}
+	if (!job->runnable) {
+	    link_crack_job(pool, job);
+	}
+	wake = pool->idleWorkers < numChunks ? pool->idleWorkers
+		: numChunks;
+	pool->idleWorkers -= wake;
+    }
+    release_lock(&pool->schedLock);
+    if (dict) {
+	release_dictionary(dict);
+    }
+    for (int i = 0; i < wake; i++) {
+	release_lock(&pool->workAvailable);
+    }
+}
+
+// Function that answers a crack request without a pass, with the found and
+// result it already has.
+void answer_crack_request(WorkerPool* pool, CrackWaiter* waiter) {
+
+    take_lock(&pool->schedLock);
+    waiter->job = NULL;
+    waiter->cancelled = false;
+    if (waiter->complete) {
+	waiter->complete(waiter);
+    } else {
+	wake_crack_waiter(waiter);
+    }
+    release_lock(&pool->schedLock);
+}
+
+// Function that removes an answered waiter from its pass, caches its answer
+// unless it was cancelled, and wakes the waiting client thread. The pass
+// then only runs as far as the windows of the waiters left need, and a pass
+// left without waiters stops handing out chunks and has its workers stop
+// after their current batch, so they move on to other clients' passes. Must
+// be called with the pool's schedLock held.
+void remove_waiter(WorkerPool* pool, CrackJob* job, CrackWaiter* waiter) {
+
+    CrackWaiter** link = &job->waiters;
+    while (*link != waiter) {
+	link = &(*link)->next;
+    }
+    *link = waiter->next;
+    waiter->job = NULL;
+    job->weight -= waiter->weight;
+    if (job->credit > job->weight) {
+	job->credit = job->weight;
+    }
+    job->endPosition = job->nextPosition;
+    for (CrackWaiter* other = job->waiters; other; other = other->next) {
+	if (other->joinPosition + job->numCandidates > job->endPosition) {
+	    job->endPosition = other->joinPosition + job->numCandidates;
+	}
+    }
+    if (job->waiters == NULL) {
+	__atomic_store_n(&job->active, false, __ATOMIC_RELEASE);
+    }
+    if (job->nextPosition >= job->endPosition) {
+	unlink_crack_job(pool, job);
+    }
+    rebuild_cipher_set(job);
+    if (!waiter->cancelled) {
+	store_crack_cache(pool, waiter, job->scope);
+    }
+    if (waiter->complete) {
+	waiter->complete(waiter);
+    } else {
+	wake_crack_waiter(waiter);
+    }
+}
+
+// Function that wakes the client thread waiting on an answered crack
+// request: posts done, then bumps the thread's eventfd so it stops
+// watching its socket. wakeFd is read first, as the waiter may be gone
+// once done is posted. Must be called with the pool's schedLock held.
+void wake_crack_waiter(CrackWaiter* waiter) {
+
+    uint64_t one = 1;
+    int wakeFd = waiter->wakeFd;
+    release_lock(&waiter->done);
+    if (write(wakeFd, &one, sizeof(uint64_t)) < 0) {
+	// Already pending, the thread will wake anyway
+	return;
+    }
+}
+
+// Function that withdraws a crack request whose client has gone, if it has
+// not been answered yet. It is answered (with cancelled set) the same way
+// as any other request. Must be called with the pool's schedLock held.
+void cancel_waiter(WorkerPool* pool, CrackWaiter* waiter) {
+
+    if (waiter->job) {
+	CrackJob* job = waiter->job;
+	waiter->cancelled = true;
+	remove_waiter(pool, job, waiter);
+	retire_crack_job(pool, job);
+    }
+}
+
+// Function that answers every waiter of a pass whose ciphertext is the
+// given one with the given word (as its dictionary slot), learning a hit
+// for the word if it is a dictionary word as it is. Must be called with
+// the pool's schedLock held.
+void answer_matching_waiters(WorkerPool* pool, CrackJob* job,
+	char* cipherText, uint64_t word) {
+
+    CrackWaiter* waiter = job->waiters;
+    while (waiter) {
+	CrackWaiter* next = waiter->next;
+	if (strcmp(waiter->cipherText, cipherText) == 0) {
+	    waiter->found = true;
+	    unpack_word(word, waiter->result);
+	    remove_waiter(pool, job, waiter);
+	    // Plain dictionary words are learned for the next load
+	    if (job->dict && job->dict->hits && !job->rules
+		    && !job->combine) {
+		record_word_hit(job->dict->hits, word);
+	    }
+	}
+	waiter = next;
+    }
+}
+
+// Function that claims the next chunk of work for a worker, taking chunks
+// from the ring of runnable passes in weighted round robin order - each pass
+// hands out as many chunks in a row as the summed weight of its waiters.
+// A chunk never wraps past the last candidate. Must be called with
+// the pool's schedLock held. Returns false if no pass has work left.
+bool claim_crack_chunk(WorkerPool* pool, CrackTask* task) {
+
+    CrackJob* job = pool->current;
+    if (job == NULL) {
+	return false;
+    }
+    long numCandidates = job->numCandidates;
+    long length = pool->chunkSize;
+    task->job = job;
+    task->startPosition = job->nextPosition;
+    task->startIndex = job->nextPosition % numCandidates;
+    if (length > numCandidates - task->startIndex) {
+	length = numCandidates - task->startIndex;
+    }
+    if (length > job->endPosition - job->nextPosition) {
+	length = job->endPosition - job->nextPosition;
+    }
+    task->endIndex = task->startIndex + length;
+    task->cipherSet = job->cipherSet;
+    task->cipherSet->refs += 1;
+    job->nextPosition += length;
+    job->chunksOutstanding += 1;
+    if (job->nextPosition >= job->endPosition) {
+	unlink_crack_job(pool, job);
+    } else if (--job->credit <= 0) {
+	job->credit = job->weight;
+	pool->current = job->next;
+    }
+    return true;
+}
+
+// Function that records a finished chunk against every waiter of its pass
+// whose window of positions it overlaps, answering waiters that have now
+// seen every word without a match. Must be called with the pool's schedLock
+// held.
+void finish_crack_chunk(WorkerPool* pool, CrackTask* task) {
+
+    CrackJob* job = task->job;
+    long start = task->startPosition;
+    long end = start + task->endIndex - task->startIndex;
+    CrackWaiter* waiter = job->waiters;
+    while (waiter) {
+	CrackWaiter* next = waiter->next;
+	long from = start > waiter->joinPosition ? start
+		: waiter->joinPosition;
+	long to = end < waiter->joinPosition + job->numCandidates ? end
+		: waiter->joinPosition + job->numCandidates;
+	if (to > from) {
+	    waiter->remaining -= to - from;
+	    if (waiter->remaining == 0) {
+		remove_waiter(pool, job, waiter);
+	    }
+	}
+	waiter = next;
+    }
+    release_cipher_set(task->cipherSet);
+    job->chunksOutstanding -= 1;
+    retire_crack_job(pool, job);
+}
+
+// Thread function run by every crack worker. Takes in a void* which is the
+// WorkerPool the worker belongs to. Repeatedly claims a chunk from whichever
+// pass is next in the scheduler and cracks it using backend state kept for
+// the worker's lifetime, which is only set up again when the salt changes.
+// A finished chunk is recorded and the next claimed under the one hold of
+// the schedLock. Crypt calls are counted locally and added to the
+// statistics every STATS_FLUSH_CALLS calls and before sleeping. Sleeps
+// while there is no work. Never returns.
+void* crack_worker(void* ptr) {
+
+    WorkerPool* pool = (WorkerPool*)ptr;
+    void* state = pool->backend->create(pool->backend);
+    char salt[SALT_SIZE + 1] = "";
+    long cryptCalls = 0;
+    CrackTask task;
+    take_lock(&pool->schedLock);
+    while (1) {
+	if (!claim_crack_chunk(pool, &task)) {
+	    pool->idleWorkers += 1;
+	    release_lock(&pool->schedLock);
+	    update_crypt_calls(pool->stats, cryptCalls);
+	    cryptCalls = 0;
+	    take_lock(&pool->workAvailable);
+	    take_lock(&pool->schedLock);
+	    continue;
+	}
+	release_lock(&pool->schedLock);
+
+	if (strcmp(salt, task.job->salt) != 0) {
+	    pool->backend->init_salt(state, task.job->salt);
+	    strcpy(salt, task.job->salt);
+	}
+	cryptCalls += crack_cipher(&task, state, pool);
+	if (cryptCalls >= STATS_FLUSH_CALLS) {
+	    update_crypt_calls(pool->stats, cryptCalls);
+	    cryptCalls = 0;
+	}
+	take_lock(&pool->schedLock);
+	finish_crack_chunk(pool, &task);
+    }
+    return (void*)0;
+}
+
+// Tables for the DES based traditional crypt(3). Bit positions are 1 based
+// with bit 1 the most significant, as in FIPS 46.
+
+// Expansion permutation, selects the 48 bits fed to the S-boxes from R
+const int desExpansion[48] = {
+    32, 1, 2, 3, 4, 5, 4, 5, 6, 7, 8, 9,
+    8, 9, 10, 11, 12, 13, 12, 13, 14, 15, 16, 17,
+    16, 17, 18, 19, 20, 21, 20, 21, 22, 23, 24, 25,
+    24, 25, 26, 27, 28, 29, 28, 29, 30, 31, 32, 1
+};
+
+// Permutation applied to the S-box outputs
+const int desPermutation[32] = {
+    16, 7, 20, 21, 29, 12, 28, 17, 1, 15, 23, 26, 5, 18, 31, 10,
+    2, 8, 24, 14, 32, 27, 3, 9, 19, 13, 30, 6, 22, 11, 4, 25
+};
+
+// Final permutation (the inverse of the initial permutation)
+const int desFinalPermutation[64] = {
+    40, 8, 48, 16, 56, 24, 64, 32, 39, 7, 47, 15, 55, 23, 63, 31,
+    38, 6, 46, 14, 54, 22, 62, 30, 37, 5, 45, 13, 53, 21, 61, 29,
+    36, 4, 44, 12, 52, 20, 60, 28, 35, 3, 43, 11, 51, 19, 59, 27,
+    34, 2, 42, 10, 50, 18, 58, 26, 33, 1, 41, 9, 49, 17, 57, 25
+};
+
+// Permuted choice 1, selects the 56 key bits that form C and D
+const int desPermutedChoice1[56] = {
+    57, 49, 41, 33, 25, 17, 9, 1, 58, 50, 42, 34, 26, 18,
+    10, 2, 59, 51, 43, 35, 27, 19, 11, 3, 60, 52, 44, 36,
+    63, 55, 47, 39, 31, 23, 15, 7, 62, 54, 46, 38, 30, 22,
+    14, 6, 61, 53, 45, 37, 29, 21, 13, 5, 28, 20, 12, 4
+};
+
+// Permuted choice 2, selects each round's 48 subkey bits from C and D
+const int desPermutedChoice2[48] = {
+    14, 17, 11, 24, 1, 5, 3, 28, 15, 6, 21, 10,
+    23, 19, 12, 4, 26, 8, 16, 7, 27, 20, 13, 2,
+    41, 52, 31, 37, 47, 55, 30, 40, 51, 45, 33, 48,
+    44, 49, 39, 56, 34, 53, 46, 42, 50, 36, 29, 32
+};
+
+// Left rotations of C and D before each round
+const int desKeyShifts[DES_ROUNDS] = {
+    1, 1, 2, 2, 2, 2, 2, 2, 1, 2, 2, 2, 2, 2, 2, 1
+};
+
+// The eight S-boxes, indexed by row (bits 1 and 6) then column (bits 2-5)
+const unsigned char desSBoxes[8][4][16] = {
+    {{14, 4, 13, 1, 2, 15, 11, 8, 3, 10, 6, 12, 5, 9, 0, 7},
+	{0, 15, 7, 4, 14, 2, 13, 1, 10, 6, 12, 11, 9, 5, 3, 8},
+	{4, 1, 14, 8, 13, 6, 2, 11, 15, 12, 9, 7, 3, 10, 5, 0},
+	{15, 12, 8, 2, 4, 9, 1, 7, 5, 11, 3, 14, 10, 0, 6, 13}},
+    {{15, 1, 8, 14, 6, 11, 3, 4, 9, 7, 2, 13, 12, 0, 5, 10},
+	{3, 13, 4, 7, 15, 2, 8, 14, 12, 0, 1, 10, 6, 9, 11, 5},
+	{0, 14, 7, 11, 10, 4, 13, 1, 5, 8, 12, 6, 9, 3, 2, 15},
+	{13, 8, 10, 1, 3, 15, 4, 2, 11, 6, 7, 12, 0, 5, 14, 9}},
+    {{10, 0, 9, 14, 6, 3, 15, 5, 1, 13, 12, 7, 11, 4, 2, 8},
+	{13, 7, 0, 9, 3, 4, 6, 10, 2, 8, 5, 14, 12, 11, 15, 1},
+	{13, 6, 4, 9, 8, 15, 3, 0, 11, 1, 2, 12, 5, 10, 14, 7},
+	{1, 10, 13, 0, 6, 9, 8, 7, 4, 15, 14, 3, 11, 5, 2, 12}},
+    {{7, 13, 14, 3, 0, 6, 9, 10, 1, 2, 8, 5, 11, 12, 4, 15},
+	{13, 8, 11, 5, 6, 15, 0, 3, 4, 7, 2, 12, 1, 10, 14, 9},
+	{10, 6, 9, 0, 12, 11, 7, 13, 15, 1, 3, 14, 5, 2, 8, 4},
+	{3, 15, 0, 6, 10, 1, 13, 8, 9, 4, 5, 11, 12, 7, 2, 14}},
+    {{2, 12, 4, 1, 7, 10, 11, 6, 8, 5, 3, 15, 13, 0, 14, 9},
+	{14, 11, 2, 12, 4, 7, 13, 1, 5, 0, 15, 10, 3, 9, 8, 6},
+	{4, 2, 1, 11, 10, 13, 7, 8, 15, 9, 12, 5, 6, 3, 0, 14},
+	{11, 8, 12, 7, 1, 14, 2, 13, 6, 15, 0, 9, 10, 4, 5, 3}},
+    {{12, 1, 10, 15, 9, 2, 6, 8, 0, 13, 3, 4, 14, 7, 5, 11},
+	{10, 15, 4, 2, 7, 12, 9, 5, 6, 1, 13, 14, 0, 11, 3, 8},
+	{9, 14, 15, 5, 2, 8, 12, 3, 7, 0, 4, 10, 1, 13, 11, 6},
+	{4, 3, 2, 12, 9, 5, 15, 10, 11, 14, 1, 7, 6, 0, 8, 13}},
+    {{4, 11, 2, 14, 15, 0, 8, 13, 3, 12, 9, 7, 5, 10, 6, 1},
+	{13, 0, 11, 7, 4, 9, 1, 10, 14, 3, 5, 12, 2, 15, 8, 6},
+	{1, 4, 11, 13, 12, 3, 7, 14, 10, 15, 6, 8, 0, 5, 9, 2},
+	{6, 11, 13, 8, 1, 4, 10, 7, 9, 5, 0, 15, 14, 2, 3, 12}},
+    {{13, 2, 8, 4, 6, 15, 11, 1, 10, 9, 3, 14, 5, 0, 12, 7},
+	{1, 15, 13, 8, 10, 3, 7, 4, 12, 5, 6, 11, 0, 14, 9, 2},
+	{7, 11, 4, 1, 9, 12, 14, 2, 0, 6, 10, 13, 15, 3, 5, 8},
+	{2, 1, 14, 7, 4, 10, 8, 13, 15, 12, 9, 0, 3, 5, 6, 11}}
+};
+
+// The S-boxes in the form used by the bitsliced kernels. Each output bit
+// (most significant first) of each S-box is a mux tree selected by input
+// bits 1-4, whose 16 leaves are functions of input bits 5 and 6. A leaf is
+// stored as its truth table: bit (2 * b5 + b6) is the output for those
+// inputs. Derived from the S-boxes of FIPS 46.
+static const unsigned char bitsliceLeaves[8][4][16] = {
+    {{9, 1, 6, 7, 6, 14, 6, 8, 10, 7, 9, 4, 13, 9, 6, 8},
+	{13, 11, 6, 2, 8, 7, 9, 4, 11, 1, 7, 8, 7, 12, 0, 11},
+	{9, 2, 15, 1, 15, 9, 0, 6, 2, 9, 4, 13, 9, 14, 7, 2},
+	{8, 7, 4, 11, 1, 8, 15, 6, 6, 0, 9, 14, 11, 7, 1, 9}},
+    {{9, 5, 6, 10, 3, 12, 9, 6, 14, 6, 9, 1, 6, 9, 1, 14},
+	{9, 14, 3, 12, 6, 4, 3, 9, 6, 1, 12, 3, 9, 15, 8, 6},
+	{3, 12, 15, 9, 4, 9, 2, 6, 4, 7, 11, 8, 10, 6, 4, 7},
+	{15, 8, 6, 1, 5, 6, 8, 11, 2, 13, 10, 5, 3, 2, 13, 12}},
+    {{3, 13, 0, 9, 12, 9, 11, 6, 9, 6, 13, 2, 9, 6, 6, 9},
+	{10, 4, 9, 7, 4, 15, 6, 2, 5, 3, 6, 8, 10, 6, 9, 13},
+	{9, 4, 7, 11, 2, 12, 9, 3, 12, 0, 6, 9, 9, 11, 6, 7},
+	{10, 9, 6, 5, 5, 6, 9, 10, 3, 6, 12, 9, 13, 8, 11, 4}},
+    {{14, 3, 8, 5, 0, 9, 13, 14, 9, 1, 7, 14, 3, 12, 2, 9},
+	{7, 9, 14, 0, 10, 12, 4, 7, 12, 8, 1, 7, 9, 6, 11, 12},
+	{1, 7, 14, 12, 12, 2, 9, 6, 15, 8, 6, 1, 1, 13, 12, 10},
+	{7, 14, 8, 9, 9, 4, 3, 12, 10, 1, 12, 7, 7, 11, 9, 0}},
+    {{14, 8, 4, 3, 1, 14, 9, 7, 10, 6, 13, 12, 13, 9, 2, 4},
+	{6, 9, 11, 6, 6, 6, 1, 9, 1, 10, 12, 9, 11, 5, 9, 6},
+	{11, 2, 13, 5, 0, 15, 2, 9, 6, 12, 9, 3, 11, 0, 7, 12},
+	{8, 4, 9, 11, 6, 7, 11, 4, 2, 13, 6, 9, 13, 12, 4, 10}},
+    {{11, 5, 9, 6, 4, 10, 9, 12, 5, 9, 6, 11, 10, 4, 4, 11},
+	{9, 6, 10, 9, 6, 14, 5, 1, 6, 13, 8, 3, 9, 9, 6, 12},
+	{10, 13, 6, 1, 2, 9, 13, 6, 12, 3, 1, 14, 11, 12, 2, 5},
+	{12, 4, 3, 10, 12, 3, 12, 7, 9, 5, 10, 6, 3, 10, 5, 9}},
+    {{6, 6, 9, 13, 6, 9, 12, 2, 8, 15, 1, 6, 7, 12, 2, 9},
+	{3, 12, 3, 4, 6, 14, 9, 9, 6, 6, 9, 13, 12, 9, 6, 8},
+	{4, 15, 1, 8, 11, 4, 14, 9, 10, 1, 4, 15, 5, 9, 10, 6},
+	{6, 10, 9, 6, 9, 7, 9, 4, 9, 7, 6, 9, 14, 8, 4, 3}},
+    {{9, 11, 6, 1, 7, 12, 8, 3, 4, 2, 13, 11, 10, 7, 1, 12},
+	{9, 6, 5, 10, 10, 6, 9, 5, 1, 11, 6, 9, 14, 4, 9, 3},
+	{12, 0, 15, 3, 1, 15, 8, 12, 7, 10, 8, 5, 6, 1, 7, 10},
+	{11, 2, 12, 7, 12, 9, 1, 6, 13, 12, 1, 8, 2, 6, 15, 9}}
+};
+
+// Function that derives the salt independent tables used by the DES based
+// crypt backends from the DES tables. Must be called before any backend is
+// used.
+void init_des_tables(DesTables* tables) {
+
+    int cd[56];
+    memset(tables, 0, sizeof(DesTables));
+    // Key bit (0 based, within the 64 bit key block) of every subkey bit
+    for (int i = 0; i < 56; i++) {
+	cd[i] = desPermutedChoice1[i] - 1;
+    }
+    for (int round = 0; round < DES_ROUNDS; round++) {
+	for (int shift = 0; shift < desKeyShifts[round]; shift++) {
+	    int c = cd[0];
+	    int d = cd[28];
+	    memmove(cd, cd + 1, sizeof(int) * 27);
+	    memmove(cd + 28, cd + 29, sizeof(int) * 27);
+	    cd[27] = c;
+	    cd[55] = d;
+	}
+	for (int i = 0; i < 48; i++) {
+	    tables->keyBits[round][i] = cd[desPermutedChoice2[i] - 1];
+	}
+    }
+    // Bit of L that each S-box output bit is xored into
+    for (int i = 0; i < 32; i++) {
+	tables->sBoxTarget[desPermutation[i] - 1] = i;
+    }
+    // C and D (as 56 bits, C first) contributed by each key character,
+    // whose 7 bits are key bits 1-7 of its byte
+    for (int i = 0; i < 56; i++) {
+	int keyBit = desPermutedChoice1[i] - 1;
+	for (int value = 0; value < 128; value++) {
+	    if (keyBit % 8 < 7 && (value & (0x40 >> (keyBit % 8)))) {
+		tables->keyChoice[keyBit / 8][value] |=
+			(uint64_t)1 << (55 - i);
+	    }
+	}
+    }
+    // Subkey bits contributed by each 7 bit group of C and D
+    for (int i = 0; i < 48; i++) {
+	int cdBit = desPermutedChoice2[i] - 1;
+	for (int value = 0; value < 128; value++) {
+	    if (value & (0x40 >> (cdBit % 7))) {
+		tables->subkeyChoice[cdBit / 7][value] |=
+			(uint64_t)1 << (47 - i);
+	    }
+	}
+    }
+    // Each S-box combined with the permutation of its output bits
+    for (int box = 0; box < 8; box++) {
+	for (int in = 0; in < 64; in++) {
+	    int row = ((in >> 4) & 2) | (in & 1);
+	    int output = desSBoxes[box][row][(in >> 1) & 15];
+	    for (int bit = 0; bit < 4; bit++) {
+		if (output & (8 >> bit)) {
+		    tables->sBoxPermuted[box][in] |= (uint32_t)1
+			    << (31 - tables->sBoxTarget[box * 4 + bit]);
+		}
+	    }
+	}
+    }
+}
+
+// Function that returns the 6 bit value of a character of a traditional
+// crypt(3) salt or result - its position in CRYPT_ALPHABET - or -1 if it is
+// not in CRYPT_ALPHABET.
+int crypt_char_value(char c) {
+
+    if (c >= 'a' && c <= 'z') {
+	return c - 'a' + 38;
+    } else if (c >= 'A' && c <= 'Z') {
+	return c - 'A' + 12;
+    } else if (c >= '.' && c <= '9') {
+	return c - '.';
+    }
+    return -1;
+}
+
+// Function that fills in the expansion table (0 based bits of R) for the
+// given salt - for each salt bit i that is set, outputs i and i + 24 of the
+// expansion are swapped.
+void salt_expansion(const char* salt, int* expansion) {
+
+    int saltBits = crypt_char_value(salt[0])
+	    | (crypt_char_value(salt[1]) << 6);
+    for (int i = 0; i < 48; i++) {
+	expansion[i] = desExpansion[i] - 1;
+    }
+    for (int i = 0; i < 12; i++) {
+	if (saltBits & (1 << i)) {
+	    int swap = expansion[i];
+	    expansion[i] = expansion[i + 24];
+	    expansion[i + 24] = swap;
+	}
+    }
+}
+
+// Function that encodes the raw 64 bit result of a traditional crypt(3) as
+// the 13 character string crypt_r() returns - the salt followed by the
+// result in 6 bit groups, the last group padded with two zero bits.
+// out must hold at least MAX_CIPHER_SIZE + 1 characters.
+void encode_crypt_result(const char* salt, uint64_t result, char* out) {
+
+    out[0] = salt[0];
+    out[1] = salt[1];
+    for (int i = 0; i < 10; i++) {
+	out[SALT_SIZE + i] = CRYPT_ALPHABET[(result >> (58 - 6 * i)) & 63];
+    }
+    out[SALT_SIZE + 10] = CRYPT_ALPHABET[(result << 2) & 63];
+    out[MAX_CIPHER_SIZE] = '\0';
+}
+
+// Function that decodes the raw 64 bit result from a 13 character
+// ciphertext, the reverse of encode_crypt_result(). Returns false if no
+// traditional crypt(3) result has that text.
+bool decode_crypt_result(const char* cipherText, uint64_t* result) {
+
+    uint64_t value = 0;
+    for (int i = 0; i < 10; i++) {
+	int bits = crypt_char_value(cipherText[SALT_SIZE + i]);
+	if (bits < 0) {
+	    return false;
+	}
+	value = (value << 6) | bits;
+    }
+    int last = crypt_char_value(cipherText[SALT_SIZE + 10]);
+    if (last < 0 || (last & 3)) {
+	// The padding bits are always zero
+	return false;
+    }
+    *result = (value << 4) | (last >> 2);
+    return true;
+}
+
+// Structure to hold a libcrypt backend's per thread state
+typedef struct {
+    struct crypt_data data;
+    char salt[SALT_SIZE + 1];
+} LibcryptState;
+
+// Function that creates the state for the libcrypt backend.
+void* libcrypt_create(const CryptBackend* backend) {
+
+    // crypt_data is large, so keep it off the caller's stack
+    LibcryptState* state = malloc(sizeof(LibcryptState));
+    memset(state, 0, sizeof(LibcryptState));
+    return state;
+}
+
+// Function that sets up the libcrypt backend's state for the given salt.
+void libcrypt_init_salt(void* ptr, const char* salt) {
+
+    LibcryptState* state = (LibcryptState*)ptr;
+    retrieve_salt((char*)salt, state->salt);
+}
+
+// Function that hashes a batch of words with crypt_r(). A word crypt_r()
+// rejects gets a result of zero, which is harmless as every match is
+// confirmed against the encoded result.
+void libcrypt_hash_batch(void* ptr, const uint64_t* words, int count,
+	uint64_t* results) {
+
+    LibcryptState* state = (LibcryptState*)ptr;
+    char word[MAX_PHRASE_SIZE + 1];
+    for (int i = 0; i < count; i++) {
+	unpack_word(words[i], word);
+	char* cipherText = crypt_r(word, state->salt, &state->data);
+	if (cipherText == NULL || !decode_crypt_result(cipherText,
+		results + i)) {
+	    results[i] = 0;
+	}
+    }
+}
+
+// Structure to hold the scalar DES backend's per thread state: the
+// expansion (with the salt's swaps applied) of each byte of R, so a round
+// needs four lookups to expand R rather than a pass over the salt bits.
+typedef struct {
+    uint64_t expansion[4][256];
+} ScalarDesState;
+
+// Function that creates the state for the scalar DES backend.
+void* scalar_des_create(const CryptBackend* backend) {
+
+    ScalarDesState* state = malloc(sizeof(ScalarDesState));
+    memset(state, 0, sizeof(ScalarDesState));
+    return state;
+}
+
+// Function that builds the scalar DES backend's expansion tables for the
+// given salt.
+void scalar_des_init_salt(void* ptr, const char* salt) {
+
+    ScalarDesState* state = (ScalarDesState*)ptr;
+    int expansion[48];
+    salt_expansion(salt, expansion);
+    memset(state->expansion, 0, sizeof(state->expansion));
+    for (int i = 0; i < 48; i++) {
+	int byte = expansion[i] / 8;
+	int mask = 0x80 >> (expansion[i] % 8);
+	for (int value = 0; value < 256; value++) {
+	    if (value & mask) {
+		state->expansion[byte][value] |= (uint64_t)1 << (47 - i);
+	    }
+	}
+    }
+}
+
+// Function that hashes a batch of words with the table driven scalar DES
+// engine. The key schedule is built from the key characters with table
+// lookups, then each of the 400 rounds is four expansion lookups and eight
+// combined S-box and permutation lookups.
+void scalar_des_hash_batch(void* ptr, const uint64_t* words, int count,
+	uint64_t* results) {
+
+    ScalarDesState* state = (ScalarDesState*)ptr;
+    const DesTables* t = &desTables;
+    uint64_t (*expansion)[256] = state->expansion;
+    uint64_t subkeys[DES_ROUNDS];
+    for (int w = 0; w < count; w++) {
+	const unsigned char* word = (const unsigned char*)&words[w];
+	uint64_t cd = 0;
+	for (int i = 0; i < MAX_PHRASE_SIZE && word[i]; i++) {
+	    cd |= t->keyChoice[i][word[i] & 0x7f];
+	}
+	uint32_t c = cd >> 28;
+	uint32_t d = cd & 0xfffffff;
+	for (int round = 0; round < DES_ROUNDS; round++) {
+	    int shift = desKeyShifts[round];
+	    c = ((c << shift) | (c >> (28 - shift))) & 0xfffffff;
+	    d = ((d << shift) | (d >> (28 - shift))) & 0xfffffff;
+	    cd = ((uint64_t)c << 28) | d;
+	    subkeys[round] = 0;
+	    for (int group = 0; group < 8; group++) {
+		subkeys[round] |= t->subkeyChoice[group]
+			[(cd >> (49 - group * 7)) & 0x7f];
+	    }
+	}
+	// Encrypt a zero block CRYPT_ITERATIONS times, the permutations
+	// between iterations cancel out and the initial permutation of a
+	// zero block is zero.
+	uint32_t l = 0;
+	uint32_t r = 0;
+	for (int iteration = 0; iteration < CRYPT_ITERATIONS; iteration++) {
+	    for (int round = 0; round < DES_ROUNDS; round++) {
+		uint64_t e = expansion[0][r >> 24]
+			| expansion[1][(r >> 16) & 0xff]
+			| expansion[2][(r >> 8) & 0xff]
+			| expansion[3][r & 0xff];
+		e ^= subkeys[round];
+		l ^= t->sBoxPermuted[0][(e >> 42) & 63]
+			| t->sBoxPermuted[1][(e >> 36) & 63]
+			| t->sBoxPermuted[2][(e >> 30) & 63]
+			| t->sBoxPermuted[3][(e >> 24) & 63]
+			| t->sBoxPermuted[4][(e >> 18) & 63]
+			| t->sBoxPermuted[5][(e >> 12) & 63]
+			| t->sBoxPermuted[6][(e >> 6) & 63]
+			| t->sBoxPermuted[7][e & 63];
+		uint32_t swap = l;
+		l = r;
+		r = swap;
+	    }
+	    // DES outputs R16 L16, so undo the last round's swap
+	    uint32_t swap = l;
+	    l = r;
+	    r = swap;
+	}
+	uint64_t block = ((uint64_t)l << 32) | r;
+	results[w] = 0;
+	for (int i = 0; i < 64; i++) {
+	    results[w] |= ((block >> (64 - desFinalPermutation[i])) & 1)
+		    << (63 - i);
+	}
+    }
+}
+
+// Macro that evaluates S-box box over every lane of vector type V. Takes in
+// the six input bit vectors (most significant first) and xors the four
+// output bit vectors into their bits of l. The leaf table is constant so
+// once unrolled the compiler can simplify every mux tree.
+#define BITSLICE_SBOX(V, tables, box, in, l) do { \
+    V leaves[16]; \
+    V minterms[4]; \
+    V level[8]; \
+    V zero = {0}; \
+    minterms[0] = ~in[4] & ~in[5]; \
+    minterms[1] = ~in[4] & in[5]; \
+    minterms[2] = in[4] & ~in[5]; \
+    minterms[3] = in[4] & in[5]; \
+    leaves[0] = zero; \
+    _Pragma("GCC unroll 16") \
+    for (int i = 1; i < 16; i++) { \
+	leaves[i] = leaves[i & (i - 1)] | minterms[__builtin_ctz(i)]; \
+    } \
+    _Pragma("GCC unroll 4") \
+    for (int bit = 0; bit < 4; bit++) { \
+	const unsigned char* leaf = bitsliceLeaves[box][bit]; \
+	_Pragma("GCC unroll 8") \
+	for (int i = 0; i < 8; i++) { \
+	    V low = leaves[leaf[2 * i]]; \
+	    level[i] = low ^ ((low ^ leaves[leaf[2 * i + 1]]) & in[3]); \
+	} \
+	_Pragma("GCC unroll 4") \
+	for (int i = 0; i < 4; i++) { \
+	    level[i] = level[2 * i] \
+		    ^ ((level[2 * i] ^ level[2 * i + 1]) & in[2]); \
+	} \
+	level[0] ^= (level[0] ^ level[1]) & in[1]; \
+	level[1] = level[2] ^ ((level[2] ^ level[3]) & in[1]); \
+	level[0] ^= (level[0] ^ level[1]) & in[0]; \
+	l[tables->sBoxTarget[box * 4 + bit]] ^= level[0]; \
+    } \
+} while (0)
+
+// Macro that defines a bitsliced traditional crypt(3) kernel for vector
+// type V, which holds one bit of the DES state for each of its lanes.
+// The function takes in up to (bits in V) words as dictionary slots and
+// their count, the DES tables and the salt's expansion
+// table, and stores the raw 64 bit result of each word in results.
+#define DEFINE_BITSLICE_KERNEL(function, V, attributes) \
+attributes void function(const uint64_t* words, int count, \
+	const DesTables* tables, const int* expansion, uint64_t* results) { \
+    V keys[64]; \
+    V halves[2][32]; \
+    V in[6]; \
+    memset(keys, 0, sizeof(keys)); \
+    memset(halves, 0, sizeof(halves)); \
+    /* Key byte i is character i shifted left once, so bit 8 of every */ \
+    /* byte (the parity bit) is never set. */ \
+    for (int lane = 0; lane < count; lane++) { \
+	uint64_t laneBit = (uint64_t)1 << (lane % 64); \
+	const unsigned char* word = (const unsigned char*)&words[lane]; \
+	for (int i = 0; i < MAX_PHRASE_SIZE && word[i]; i++) { \
+	    for (int bit = 0; bit < 7; bit++) { \
+		if (word[i] & (0x40 >> bit)) { \
+		    keys[i * 8 + bit][lane / 64] |= laneBit; \
+		} \
+	    } \
+	} \
+    } \
+    /* Encrypt a zero block CRYPT_ITERATIONS times, the permutations */ \
+    /* between iterations cancel out and the initial permutation of a */ \
+    /* zero block is zero. l and r swap roles rather than being copied. */ \
+    V* l = halves[0]; \
+    V* r = halves[1]; \
+    V* swap; \
+    for (int iteration = 0; iteration < CRYPT_ITERATIONS; iteration++) { \
+	for (int round = 0; round < DES_ROUNDS; round++) { \
+	    const int* keyBits = tables->keyBits[round]; \
+	    _Pragma("GCC unroll 8") \
+	    for (int box = 0; box < 8; box++) { \
+		_Pragma("GCC unroll 6") \
+		for (int i = 0; i < 6; i++) { \
+		    in[i] = r[expansion[box * 6 + i]] \
+			    ^ keys[keyBits[box * 6 + i]]; \
+		} \
+		BITSLICE_SBOX(V, tables, box, in, l); \
+	    } \
+	    swap = l, l = r, r = swap; \
+	} \
+	/* DES outputs R16 L16, so undo the last round's swap */ \
+	swap = l, l = r, r = swap; \
+    } \
+    /* Apply the final permutation to l (R16) followed by r (L16) */ \
+    for (int lane = 0; lane < count; lane++) { \
+	results[lane] = 0; \
+    } \
+    for (int i = 0; i < 64; i++) { \
+	int from = desFinalPermutation[i] - 1; \
+	V source = from < 32 ? l[from] : r[from - 32]; \
+	for (int lane = 0; lane < count; lane++) { \
+	    uint64_t bit = (source[lane / 64] >> (lane % 64)) & 1; \
+	    results[lane] |= bit << (63 - i); \
+	} \
+    } \
+}
+
+DEFINE_BITSLICE_KERNEL(bitslice_crypt_64, BitVector64, )
+#if defined(__x86_64__) || defined(__i386__)
+DEFINE_BITSLICE_KERNEL(bitslice_crypt_sse2, BitVector128,
+	__attribute__((target("sse2"))))
+DEFINE_BITSLICE_KERNEL(bitslice_crypt_avx2, BitVector256,
+	__attribute__((target("avx2"))))
+DEFINE_BITSLICE_KERNEL(bitslice_crypt_avx512, BitVector512,
+	__attribute__((target("avx512f"))))
+#endif
+
+// Structure to hold a bitsliced backend's per thread state
+typedef struct {
+    const CryptBackend* backend;
+    int expansion[48];
+} BitsliceState;
+
+// Function that creates the state for a bitsliced backend.
+void* bitslice_create(const CryptBackend* backend) {
+
+    BitsliceState* state = malloc(sizeof(BitsliceState));
+    memset(state, 0, sizeof(BitsliceState));
+    state->backend = backend;
+    return state;
+}
+
+// Function that sets up a bitsliced backend's state for the given salt.
+void bitslice_init_salt(void* ptr, const char* salt) {
+
+    BitsliceState* state = (BitsliceState*)ptr;
+    salt_expansion(salt, state->expansion);
+}
+
+// Function that hashes a batch of words with a bitsliced backend's kernel.
+void bitslice_hash_batch(void* ptr, const uint64_t* words, int count,
+	uint64_t* results) {
+
+    BitsliceState* state = (BitsliceState*)ptr;
+    state->backend->kernel(words, count, &desTables, state->expansion,
+	    results);
+}
+
+// The crypt backends in order of preference. The bitsliced backends are
+// also selectable together as "bitslice", which picks the widest the CPU
+// supports.
+const CryptBackend cryptBackends[] = {
+#if defined(__x86_64__) || defined(__i386__)
+    { .name = "avx512", .isa = "avx512f", .batchSize = 512,
+	    .kernel = bitslice_crypt_avx512, .create = bitslice_create,
+	    .init_salt = bitslice_init_salt,
+	    .hash_batch = bitslice_hash_batch },
+    { .name = "avx2", .isa = "avx2", .batchSize = 256,
+	    .kernel = bitslice_crypt_avx2, .create = bitslice_create,
+	    .init_salt = bitslice_init_salt,
+	    .hash_batch = bitslice_hash_batch },
+    { .name = "sse2", .isa = "sse2", .batchSize = 128,
+	    .kernel = bitslice_crypt_sse2, .create = bitslice_create,
+	    .init_salt = bitslice_init_salt,
+	    .hash_batch = bitslice_hash_batch },
+#endif
+    { .name = "bitslice64", .isa = NULL, .batchSize = 64,
+	    .kernel = bitslice_crypt_64, .create = bitslice_create,
+	    .init_salt = bitslice_init_salt,
+	    .hash_batch = bitslice_hash_batch },
+    { .name = "des", .isa = NULL, .batchSize = 64,
+	    .kernel = NULL, .create = scalar_des_create,
+	    .init_salt = scalar_des_init_salt,
+	    .hash_batch = scalar_des_hash_batch },
+    { .name = "libcrypt", .isa = NULL, .batchSize = 64,
+	    .kernel = NULL, .create = libcrypt_create,
+	    .init_salt = libcrypt_init_salt,
+	    .hash_batch = libcrypt_hash_batch },
+};
+
+// Function that returns true if the CPU supports the instruction set the
+// given backend was compiled for.
+bool crypt_backend_supported(const CryptBackend* backend) {
+
+    if (backend->isa == NULL) {
+	return true;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (!strcmp(backend->isa, "avx512f")) {
+	return __builtin_cpu_supports("avx512f");
+    } else if (!strcmp(backend->isa, "avx2")) {
+	return __builtin_cpu_supports("avx2");
+    } else if (!strcmp(backend->isa, "sse2")) {
+	return __builtin_cpu_supports("sse2");
+    }
+#endif
+    return false;
+}
+
+// Function that checks a backend against crypt_r() over a full batch of
+// test words and a few salts. Returns true if every result is identical.
+bool verify_crypt_backend(const CryptBackend* backend) {
+
+    char* salts[] = {"ab", "./", "zZ", "9."};
+    char storage[CRYPT_MAX_BATCH][MAX_PHRASE_SIZE + 1];
+    uint64_t words[CRYPT_MAX_BATCH];
+    uint64_t results[CRYPT_MAX_BATCH];
+    char encoded[MAX_CIPHER_SIZE + 1];
+    void* state = backend->create(backend);
+    bool same = true;
+    struct crypt_data* data = malloc(sizeof(struct crypt_data));
+    memset(data, 0, sizeof(struct crypt_data));
+    // Words of every length, including the empty word
+    for (int i = 0; i < backend->batchSize; i++) {
+	int length = i % (MAX_PHRASE_SIZE + 1);
+	for (int j = 0; j < length; j++) {
+	    storage[i][j] = CHAR_SET[(i * 7 + j * 13) % strlen(CHAR_SET)];
+	}
+	storage[i][length] = '\0';
+	words[i] = pack_word(storage[i], length);
+    }
+    for (int s = 0; s < sizeof(salts) / sizeof(char*); s++) {
+	backend->init_salt(state, salts[s]);
+	backend->hash_batch(state, words, backend->batchSize, results);
+	for (int i = 0; i < backend->batchSize; i++) {
+	    encode_crypt_result(salts[s], results[i], encoded);
+	    if (strcmp(encoded, crypt_r(storage[i], salts[s], data)) != 0) {
+		same = false;
+	    }
+	}
+    }
+    free(data);
+    free(state);
+    return same;
+}
+
+// Function that selects the crypt backend with the given name (NULL or
+// "bitslice" for the widest bitsliced backend the CPU supports). A backend
+// that does not give the same results as crypt_r() is never used, the
+// libcrypt backend is used instead. Returns NULL if the name is unknown.
+const CryptBackend* select_crypt_backend(const char* name) {
+
+    int numBackends = sizeof(cryptBackends) / sizeof(CryptBackend);
+    const CryptBackend* libcrypt = &cryptBackends[numBackends - 1];
+    bool bitslice = name == NULL || !strcmp(name, "bitslice");
+    bool known = false;
+    for (int i = 0; i < numBackends; i++) {
+	const CryptBackend* backend = &cryptBackends[i];
+	if (bitslice ? backend->kernel == NULL
+		: strcmp(name, backend->name) != 0) {
+	    continue;
+	}
+	known = true;
+	if (backend == libcrypt || (crypt_backend_supported(backend)
+		&& verify_crypt_backend(backend))) {
+	    return backend;
+	}
+    }
+    if (!known) {
+	return NULL;
+    }
+    fprintf(stderr, "crackserver: crypt backend \"%s\" unavailable, "
+	    "using libcrypt\n", bitslice ? "bitslice" : name);
+    return libcrypt;
+}
+
+// Function that returns the number of seconds elapsed since the given time.
+double seconds_since(struct timespec* start) {
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec)
+	    + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Function that runs the --benchmark mode. For every crypt backend the CPU
+// supports it hashes the dictionary (repeating it for at least a second)
+// with a fixed salt, checks every result against crypt_r() and prints the
+// number of crypts per second. Exits with a non zero exit status if any
+// result differs.
+void run_benchmark(Dictionary dict) {
+
+    char* salt = "ab";
+    int numBackends = sizeof(cryptBackends) / sizeof(CryptBackend);
+    char word[MAX_PHRASE_SIZE + 1];
+    uint64_t results[CRYPT_MAX_BATCH];
+    char encoded[MAX_CIPHER_SIZE + 1];
+    struct timespec start;
+    bool mismatch = false;
+    struct crypt_data* data = malloc(sizeof(struct crypt_data));
+    memset(data, 0, sizeof(struct crypt_data));
+
+    char** expected = malloc(sizeof(char*) * dict.numWords);
+    for (int i = 0; i < dict.numWords; i++) {
+	unpack_word(dict.slots[i], word);
+	expected[i] = strdup(crypt_r(word, salt, data));
+    }
+    for (int b = 0; b < numBackends; b++) {
+	const CryptBackend* backend = &cryptBackends[b];
+	if (!crypt_backend_supported(backend)) {
+	    continue;
+	}
+	void* state = backend->create(backend);
+	long count = 0;
+	int index = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	backend->init_salt(state, salt);
+	do {
+	    int batch = dict.numWords - index < backend->batchSize
+		    ? dict.numWords - index : backend->batchSize;
+	    backend->hash_batch(state, dict.slots + index, batch, results);
+	    // Only the first pass over the dictionary is checked
+	    for (int i = 0; count < dict.numWords && i < batch; i++) {
+		encode_crypt_result(salt, results[i], encoded);
+		if (strcmp(encoded, expected[index + i]) != 0) {
+		    unpack_word(dict.slots[index + i], word);
+		    fprintf(stderr, "%s: \"%s\" gave %s, crypt_r gave %s\n",
+			    backend->name, word, encoded,
+			    expected[index + i]);
+		    mismatch = true;
+		}
+	    }
+	    count += batch;
+	    index = (index + batch) % dict.numWords;
+	} while (count < dict.numWords || seconds_since(&start) < 1);
+	printf("%s (batch %d): %.0f crypts/sec\n", backend->name,
+		backend->batchSize, count / seconds_since(&start));
+	free(state);
+    }
+    fflush(stdout);
+    exit(mismatch ? BENCHMARK_ERROR : 0);
+}
+
+// Function to check that the supplied arguments are valid. 
+// Takes in a list of string arguments, the list's length and the jobType 
 // using this function. If all the supplied arguments are valid then true is
 // returned otherwise false.
 bool valid_args(char** args, int length, int jobType) {
 
-    // Job type 0 = crypt, Job Type 1 = crack
-    bool result = true;
-    int threadCount;
-    int valid = 0;
-    switch (jobType) {
-	case 0: 
-	    if (length != 2) {
-		result = false;
-		break;
-	    }
-	    if (strlen(args[0]) > 8 || strlen(args[0]) == 0) {
-		result = false;
-	    }
-	    if (!valid_chars(args[1])) {
-		result = false;
-	    }
-	    if (strlen(args[1]) != 3) {
-		result = false;
+    // Job type 0 = crypt, Job Type 1 = crack
+    bool result = true;
+    int threadCount;
+    int valid = 0;
+    switch (jobType) {
+	case 0: 
+	    if (length != 2) {
+		result = false;
+		break;
+	    }
+	    if (strlen(args[0]) > 8 || strlen(args[0]) == 0) {
+		result = false;
+	    }
+	    if (!valid_chars(args[1])) {
+		result = false;
+	    }
+	    if (strlen(args[1]) != 3) {
+		result = false;
+	    }
+	    break;
+	case 1:
+	    if (strlen(args[0]) != 13) {
+		// check ciphertext validity
+		result = false;
+		break;
+	    }
+	    if (strchr(CHAR_SET, args[0][0]) == NULL 
+		    || strchr(CHAR_SET, args[0][1]) == NULL) {
+		result = false;
+	    }
+	    if (length == 2) {
+		valid = is_valid_number(args[1]);
+		// check thread number validity
+		if (valid != 0) {
+		    result = false;
+		}
+		threadCount = atoi(args[1]);
+		if (threadCount < 1 || threadCount > 50) {
+		    result = false;
+		}
+	    }
+	    break;
+    }
+    return result;
+}
+
+// Function to obtain the server socket on the given port. Takes in a port
+// number and attempts to gather address info. If successful it attempts to 
+// create a socket and bind it to the port then listen for incoming
+// connections. Returns the server socket.
+int get_serv_socket(const char* port) {
+
+    struct addrinfo* ai = 0;
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    int err;
+    if ((err = getaddrinfo(NULL, port, &hints, &ai))) {
+	freeaddrinfo(ai);
+	socket_open_error();
+    }
+    // create a socket and bind it to a port
+    int serv = socket(AF_INET, SOCK_STREAM, 0);
+    int optVal = 1;
+    if (setsockopt(serv, SOL_SOCKET, SO_REUSEADDR, &optVal, sizeof(int)) < 0) {
+	socket_open_error();
+    }
+    if (bind(serv, ai->ai_addr, sizeof(struct sockaddr))) {
+	socket_open_error();
+    }
+    if (listen(serv, 10) < 0) {	
+	socket_open_error();
+    }
+    // Get port number if supplied port was zero.
+    if (strcmp(port, "0") == 0) {
+	struct sockaddr_in ad;
+	memset(&ad, 0, sizeof(struct sockaddr_in));
+	socklen_t len = sizeof(struct sockaddr_in);
+	if (getsockname(serv, (struct sockaddr*)&ad, &len)) {
+	    socket_open_error();	
+	}
+	// print port number obtained ad.sin_port
+	fprintf(stderr, "%u\n", ntohs(ad.sin_port));
+	fflush(stderr);
+    } else {
+	//print supplied port
+	fprintf(stderr, "%s\n", port);
+	fflush(stderr);
+    }
+    return serv;
+}
+
+// Function that retrieves the salt from the supplied cipherText argument
+// and stores it in the supplied salt buffer (at least SALT_SIZE + 1 chars).
+void retrieve_salt(char* cipherText, char* salt) {
+    
+    salt[0] = cipherText[0];
+    salt[1] = cipherText[1];
+    salt[2] = '\0';
+}
+
+// Function that maps the dictionary file open on the given descriptor into
+// memory, or reads it into a buffer if it cannot be mapped (such as a
+// pipe), and closes the descriptor. Sets size to its length and mapped to
+// whether it was mapped. Returns its contents (NULL if it is empty).
+char* map_dictionary_file(int fd, size_t* size, bool* mapped) {
+
+    struct stat info;
+    *size = 0;
+    *mapped = false;
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode)) {
+	if (info.st_size == 0) {
+	    close(fd);
+	    return NULL;
+	}
+	char* data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data != MAP_FAILED) {
+	    close(fd);
+	    *size = info.st_size;
+	    *mapped = true;
+	    return data;
+	}
+    }
+    size_t capacity = DICT_MIN_CHUNK;
+    char* data = malloc(capacity);
+    ssize_t got;
+    while ((got = read(fd, data + *size, capacity - *size)) != 0) {
+	if (got < 0) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    break;
+	}
+	*size += got;
+	if (*size == capacity) {
+	    capacity *= 2;
+	    data = realloc(data, capacity);
+	}
+    }
+    close(fd);
+    return data;
+}
+
+// Function that packs a word of at most MAX_PHRASE_SIZE characters into a
+// dictionary slot. Words never contain a NUL, so the slot is unique to the
+// word.
+uint64_t pack_word(const char* word, int length) {
+
+    uint64_t slot = 0;
+    memcpy(&slot, word, length);
+    return slot;
+}
+
+// Function that unpacks the word in the given dictionary slot into word,
+// which must hold at least MAX_PHRASE_SIZE + 1 characters.
+void unpack_word(uint64_t slot, char* word) {
+
+    memcpy(word, &slot, MAX_PHRASE_SIZE);
+    word[MAX_PHRASE_SIZE] = '\0';
+}
+
+// Function that hashes a packed word for the loader's duplicate tables.
+// Similar words pack to similar keys, so the key is mixed first.
+uint64_t word_key_hash(uint64_t key) {
+
+    key ^= key >> 30;
+    key *= 0xbf58476d1ce4e5b9ULL;
+    key ^= key >> 27;
+    key *= 0x94d049bb133111ebULL;
+    return key ^ (key >> 31);
+}
+
+// Function that runs one phase of loading a dictionary, with a thread for
+// each chunk of the file (the calling thread taking the first), and waits
+// for every thread to finish it.
+void run_dictionary_loaders(DictionaryLoad* load, void* (*phase)(void*)) {
+
+    pthread_t* tids = malloc(sizeof(pthread_t) * load->numChunks);
+    for (int i = 1; i < load->numChunks; i++) {
+	pthread_create(&tids[i], NULL, phase, &load->chunks[i]);
+    }
+    phase(&load->chunks[0]);
+    for (int i = 1; i < load->numChunks; i++) {
+	pthread_join(tids[i], NULL);
+    }
+    free(tids);
+}
+
+// Function that returns the weight a dictionary line from line to lineEnd
+// gives its word - how likely the word is, such as the number of times it
+// was seen in a password leak - as a tab and a number after the word, and
+// moves lineEnd back to the end of the word. Returns 0 if the line has no
+// weight, in which case it is all word.
+long line_weight(const char* line, const char** lineEnd) {
+
+    const char* tab = memchr(line, '\t', *lineEnd - line);
+    long weight = 0;
+    if (tab == NULL || tab + 1 == *lineEnd
+	    || *lineEnd - tab > MAX_WEIGHT_DIGITS + 1) {
+	return 0;
+    }
+    for (const char* digit = tab + 1; digit < *lineEnd; digit++) {
+	if (!isdigit(*digit)) {
+	    return 0;
+	}
+	weight = weight * 10 + (*digit - '0');
+    }
+    *lineEnd = tab;
+    return weight;
+}
+
+// Thread function run by a dictionary loader. Takes in a void* which is its
+// DictionaryChunk. Packs the words of every line of the chunk into keys,
+// leaving out lines longer than MAX_PHRASE_SIZE, and notes the partition
+// each key is in and any weight its line gives. Returns NULL.
+void* scan_dictionary_chunk(void* ptr) {
+
+    DictionaryChunk* chunk = (DictionaryChunk*)ptr;
+    int numChunks = chunk->load->numChunks;
+    int capacity = (chunk->end - chunk->start) / 8 + 16;
+    const char* line = chunk->start;
+    chunk->keys = malloc(sizeof(uint64_t) * capacity);
+    chunk->partitions = malloc(capacity);
+    chunk->weights = NULL;
+    chunk->numKeys = 0;
+    while (line < chunk->end) {
+	const char* newline = memchr(line, '\n', chunk->end - line);
+	const char* lineEnd = newline ? newline : chunk->end;
+	long weight = line_weight(line, &lineEnd);
+	if (lineEnd - line <= MAX_PHRASE_SIZE) {
+	    if (chunk->numKeys == capacity) {
+		capacity *= 2;
+		chunk->keys = realloc(chunk->keys,
+			sizeof(uint64_t) * capacity);
+		chunk->partitions = realloc(chunk->partitions, capacity);
+		if (chunk->weights) {
+		    chunk->weights = realloc(chunk->weights,
+			    sizeof(long) * capacity);
+		}
+	    }
+	    if (weight > 0 && chunk->weights == NULL) {
+		chunk->weights = calloc(capacity, sizeof(long));
+	    }
+	    if (chunk->weights) {
+		chunk->weights[chunk->numKeys] = weight;
+	    }
+	    uint64_t key = pack_word(line, lineEnd - line);
+	    chunk->keys[chunk->numKeys] = key;
+	    chunk->partitions[chunk->numKeys++] = word_key_hash(key)
+		    % numChunks;
+	}
+	line = lineEnd + 1;
+    }
+    return NULL;
+}
+
+// Function that marks the given key of a loader thread's partition as
+// repeated if its word is already in the thread's table of words seen,
+// adding it otherwise. The empty word (the only key of zero) is tracked
+// apart so a zero slot is free.
+void mark_partition_key(PartitionKey* key, uint64_t* slots,
+	unsigned int mask, bool* seenEmpty, bool* repeated) {
+
+    if (key->key == 0) {
+	repeated[key->index] = *seenEmpty;
+	*seenEmpty = true;
+	return;
+    }
+    unsigned int slot = key->hash & mask;
+    while (slots[slot] != 0 && slots[slot] != key->key) {
+	slot = (slot + 1) & mask;
+    }
+    repeated[key->index] = slots[slot] != 0;
+    slots[slot] = key->key;
+}
+
+// Thread function run by a dictionary loader. Takes in a void* which is its
+// DictionaryChunk. Goes through the keys in the chunk's partition of the
+// key space (so each key is only looked at by one thread) in file order,
+// and marks each key whose word was seen before. Nearly every lookup
+// misses the cache, so keys wait in a short queue while their slot is
+// prefetched. Returns NULL.
+void* mark_repeated_words(void* ptr) {
+
+    DictionaryChunk* chunk = (DictionaryChunk*)ptr;
+    DictionaryLoad* load = chunk->load;
+    PartitionKey queue[DICT_PREFETCH];
+    int head = 0;
+    int queued = 0;
+    int count = 0;
+    unsigned int capacity = 8;
+    bool seenEmpty = false;
+    for (int c = 0; c < load->numChunks; c++) {
+	for (int k = 0; k < load->chunks[c].numKeys; k++) {
+	    count += load->chunks[c].partitions[k] == chunk->index;
+	}
+    }
+    while (capacity < count * 2) {
+	capacity *= 2;
+    }
+    uint64_t* slots = calloc(capacity, sizeof(uint64_t));
+    for (int c = 0; c < load->numChunks; c++) {
+	DictionaryChunk* other = &load->chunks[c];
+	for (int k = 0; k < other->numKeys; k++) {
+	    if (other->partitions[k] != chunk->index) {
+		continue;
+	    }
+	    PartitionKey key = { .key = other->keys[k],
+		    .hash = word_key_hash(other->keys[k]) >> 32,
+		    .index = other->firstKey + k };
+	    __builtin_prefetch(&slots[key.hash & (capacity - 1)], 1);
+	    if (queued == DICT_PREFETCH) {
+		mark_partition_key(&queue[head], slots, capacity - 1,
+			&seenEmpty, load->repeated);
+		queue[head] = key;
+		head = (head + 1) % DICT_PREFETCH;
+	    } else {
+		queue[(head + queued++) % DICT_PREFETCH] = key;
+	    }
+	}
+    }
+    for (; queued > 0; queued--) {
+	mark_partition_key(&queue[head], slots, capacity - 1, &seenEmpty,
+		load->repeated);
+	head = (head + 1) % DICT_PREFETCH;
+    }
+    free(slots);
+    return NULL;
+}
+
+// Thread function run by a dictionary loader. Takes in a void* which is its
+// DictionaryChunk. Counts the words the chunk keeps. Returns NULL.
+void* count_dictionary_chunk(void* ptr) {
+
+    DictionaryChunk* chunk = (DictionaryChunk*)ptr;
+    bool* repeated = chunk->load->repeated + chunk->firstKey;
+    chunk->numWords = 0;
+    for (int k = 0; k < chunk->numKeys; k++) {
+	chunk->numWords += !repeated[k];
+    }
+    return NULL;
+}
+
+// Thread function run by a dictionary loader. Takes in a void* which is its
+// DictionaryChunk. Copies the slots of the words the chunk keeps to its
+// part of the dictionary, and their weights if the load has any. Returns
+// NULL.
+void* fill_dictionary_chunk(void* ptr) {
+
+    DictionaryChunk* chunk = (DictionaryChunk*)ptr;
+    Dictionary* dict = chunk->load->dict;
+    bool* repeated = chunk->load->repeated + chunk->firstKey;
+    long* weights = chunk->load->weights;
+    int index = chunk->firstWord;
+    for (int k = 0; k < chunk->numKeys; k++) {
+	if (!repeated[k]) {
+	    if (weights && chunk->weights) {
+		weights[index] = chunk->weights[k];
+	    }
+	    dict->slots[index++] = chunk->keys[k];
+	}
+    }
+    free(chunk->keys);
+    free(chunk->partitions);
+    free(chunk->weights);
+    return NULL;
+}
+
+// Function that adds the hits learned for each word of the given dictionary
+// to its weight.
+void add_learned_weights(WordHits* hits, Dictionary* dict, long* weights) {
+
+    if (hits == NULL) {
+	return;
+    }
+    take_lock(&hits->lock);
+    for (int i = 0; hits->numWords > 0 && i < dict->numWords; i++) {
+	weights[i] += hits->counts[word_hit_slot(hits, dict->slots[i])];
+    }
+    release_lock(&hits->lock);
+}
+
+// Function that puts the words of the given dictionary in order of their
+// weights, heaviest first. Words of equal weight keep their order in the
+// file, so words without a weight stay as they were after every weighted
+// word.
+void order_dictionary(Dictionary* dict, long* weights) {
+
+    int* order = malloc(sizeof(int) * dict->numWords);
+    uint64_t* slots = malloc(sizeof(uint64_t) * dict->numWords);
+    int numWeighted = 0;
+    for (int i = 0; i < dict->numWords; i++) {
+	if (weights[i] > 0) {
+	    order[numWeighted++] = i;
+	}
+    }
+    qsort_r(order, numWeighted, sizeof(int), compare_word_weights, weights);
+    for (int i = 0, next = numWeighted; i < dict->numWords; i++) {
+	if (weights[i] == 0) {
+	    order[next++] = i;
+	}
+    }
+    memcpy(slots, dict->slots, sizeof(uint64_t) * dict->numWords);
+    for (int i = 0; i < dict->numWords; i++) {
+	dict->slots[i] = slots[order[i]];
+    }
+    free(slots);
+    free(order);
+}
+
+// Function that compares two word indexes for qsort_r(), heaviest of the
+// given weights first and then in file order.
+int compare_word_weights(const void* a, const void* b, void* weights) {
+
+    int first = *(const int*)a;
+    int second = *(const int*)b;
+    long firstWeight = ((long*)weights)[first];
+    long secondWeight = ((long*)weights)[second];
+    if (firstWeight != secondWeight) {
+	return firstWeight > secondWeight ? -1 : 1;
+    }
+    return first - second;
+}
+
+// Function that returns the slot of the given word in the table of learned
+// hits, or the free slot it would go in. Must be called with the table's
+// lock held, and the table must not be empty.
+int word_hit_slot(WordHits* hits, uint64_t word) {
+
+    int slot = word_key_hash(word) & (hits->capacity - 1);
+    while (hits->counts[slot] > 0 && hits->words[slot] != word) {
+	slot = (slot + 1) & (hits->capacity - 1);
+    }
+    return slot;
+}
+
+// Function that learns that the given word cracked a ciphertext, growing
+// the table of hits (which starts empty) to keep it at most half full.
+void record_word_hit(WordHits* hits, uint64_t word) {
+
+    take_lock(&hits->lock);
+    if ((hits->numWords + 1) * 2 > hits->capacity) {
+	WordHits old = *hits;
+	hits->capacity = old.capacity ? old.capacity * 2 : 16;
+	hits->words = malloc(sizeof(uint64_t) * hits->capacity);
+	hits->counts = calloc(hits->capacity, sizeof(long));
+	for (int i = 0; i < old.capacity; i++) {
+	    if (old.counts[i] > 0) {
+		int slot = word_hit_slot(hits, old.words[i]);
+		hits->words[slot] = old.words[i];
+		hits->counts[slot] = old.counts[i];
+	    }
+	}
+	free(old.words);
+	free(old.counts);
+    }
+    int slot = word_hit_slot(hits, word);
+    if (hits->counts[slot] == 0) {
+	hits->words[slot] = word;
+	hits->numWords++;
+    }
+    hits->counts[slot]++;
+    release_lock(&hits->lock);
+}
+
+// Function that attempts to open a file from the given argument and read in
+// and store its contents, printing the appropriate error message and
+// exiting with a non zero exit status if it cannot. Returns a Dictionary
+// struct containing all the words read and the number of words found.
+Dictionary parse_dictionary(char* fileName) {
+
+    Dictionary dictionary;
+    switch (load_dictionary(fileName, &dictionary, NULL)) {
+	case DICT_OPEN_ERROR:
+	    dictionary_open_error(fileName);
+	case DICT_TEXT_ERROR:
+	    dictionary_text_error();
+	case SNAPSHOT_ERROR:
+	    snapshot_corrupt_error(fileName);
+	default:
+	    return dictionary;
+    }
+}
+
+// Function that loads the dictionary file with the given name into dict. A
+// dictionary snapshot is used where it is mapped. A text file is mapped
+// into memory and split into chunks at line boundaries, which are loaded
+// by a thread each (one per DICT_MIN_CHUNK of the file, up to the number
+// of cores). A word that appears more than once is only kept the first
+// time. If any line gives its word a weight, or hits (which may be NULL)
+// has learned any, the words are put in order of weight (the learned hits
+// added on), most likely first. Never exits, so a failed reload leaves the
+// server running. Returns 0, or the exit status for the reason the file
+// could not be used.
+ExitStatus load_dictionary(char* fileName, Dictionary* dict,
+	WordHits* hits) {
+
+    Dictionary dictionary = { .numWords = 0, .slots = 0, .snapshot = 0,
+	    .snapshotSize = 0, .snapshotMapped = false, .byLength = 0,
+	    .hits = 0, .generation = 0, .tables = 0, .refs = 0};
+    DictionaryLoad load = { .dict = &dictionary };
+    size_t size;
+    bool mapped;
+    int fd = open(fileName, O_RDONLY);
+    if (fd < 0) {
+	return DICT_OPEN_ERROR;
+    }
+    char* data = map_dictionary_file(fd, &size, &mapped);
+    if (size >= sizeof(DictionarySnapshot) && !memcmp(data, SNAPSHOT_MAGIC,
+	    strlen(SNAPSHOT_MAGIC))) {
+	dictionary.snapshot = data;
+	dictionary.snapshotSize = size;
+	dictionary.snapshotMapped = mapped;
+	if (!load_dictionary_snapshot(data, size, &dictionary)) {
+	    free_dictionary(&dictionary);
+	    return SNAPSHOT_ERROR;
+	}
+	dictionary.generation = __atomic_add_fetch(&dictionaryGenerations,
+		1, __ATOMIC_RELAXED);
+	*dict = dictionary;
+	return 0;
+    }
+    if (mapped) {
+	// Every page of a text file is read once, front to back
+	madvise(data, size, MADV_SEQUENTIAL);
+    }
+    load.numChunks = size / DICT_MIN_CHUNK + 1;
+    if (load.numChunks > core_count()) {
+	load.numChunks = core_count();
+    }
+    if (load.numChunks > DICT_MAX_LOADERS) {
+	load.numChunks = DICT_MAX_LOADERS;
+    }
+    load.chunks = calloc(load.numChunks, sizeof(DictionaryChunk));
+    size_t boundary = 0;
+    for (int i = 0; i < load.numChunks; i++) {
+	DictionaryChunk* chunk = &load.chunks[i];
+	chunk->load = &load;
+	chunk->index = i;
+	chunk->start = data + boundary;
+	// Each chunk ends at the start of a line
+	boundary = size / load.numChunks * (i + 1);
+	if (i == load.numChunks - 1) {
+	    boundary = size;
+	}
+	while (boundary < size && data[boundary - 1] != '\n') {
+	    boundary++;
+	}
+	if (data + boundary < chunk->start) {
+	    boundary = chunk->start - data;
+	}
+	chunk->end = data + boundary;
+    }
+    run_dictionary_loaders(&load, scan_dictionary_chunk);
+    int numKeys = 0;
+    for (int i = 0; i < load.numChunks; i++) {
+	load.chunks[i].firstKey = numKeys;
+	numKeys += load.chunks[i].numKeys;
+    }
+    load.repeated = calloc(numKeys + 1, sizeof(bool));
+    run_dictionary_loaders(&load, mark_repeated_words);
+    run_dictionary_loaders(&load, count_dictionary_chunk);
+    bool weighted = hits && hits->numWords > 0;
+    for (int i = 0; i < load.numChunks; i++) {
+	load.chunks[i].firstWord = dictionary.numWords;
+	dictionary.numWords += load.chunks[i].numWords;
+	weighted |= load.chunks[i].weights != NULL;
+    }
+    if (weighted && dictionary.numWords > 0) {
+	load.weights = calloc(dictionary.numWords, sizeof(long));
+    }
+    if (dictionary.numWords == 0 || posix_memalign(
+	    (void**)&dictionary.slots, DICT_SLOT_ALIGN,
+	    sizeof(uint64_t) * dictionary.numWords)) {
+	dictionary.numWords = 0;
+	dictionary.slots = NULL;
+    }
+    if (dictionary.slots) {
+	run_dictionary_loaders(&load, fill_dictionary_chunk);
+	if (load.weights) {
+	    add_learned_weights(hits, &dictionary, load.weights);
+	    order_dictionary(&dictionary, load.weights);
+	}
+    } else {
+	for (int i = 0; i < load.numChunks; i++) {
+	    free(load.chunks[i].keys);
+	    free(load.chunks[i].partitions);
+	    free(load.chunks[i].weights);
+	}
+    }
+    free(load.repeated);
+    free(load.weights);
+    free(load.chunks);
+    if (mapped) {
+	munmap(data, size);
+    } else {
+	free(data);
+    }
+    if (dictionary.slots == NULL) {
+	return DICT_TEXT_ERROR;
+    }
+    dictionary.generation = __atomic_add_fetch(&dictionaryGenerations, 1,
+	    __ATOMIC_RELAXED);
+    *dict = dictionary;
+    return 0;
+}
+
+// Function that adds the given data to a snapshot checksum (FNV-1a over 64
+// bit words, then over the bytes left), starting from the given hash.
+// Returns the new hash.
+uint64_t snapshot_checksum(const void* data, size_t length, uint64_t hash) {
+
+    const unsigned char* bytes = (const unsigned char*)data;
+    uint64_t word;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+	memcpy(&word, bytes + i, sizeof(uint64_t));
+	hash = (hash ^ word) * 0x100000001b3ULL;
+    }
+    for (; i < length; i++) {
+	hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Function that uses a mapped dictionary snapshot as the dictionary dict.
+// Its slots are used where they are, so the pages are shared with every
+// other process using the same snapshot. A snapshot whose header, size or
+// checksum does not add up is never used. Returns false if it is corrupt.
+bool load_dictionary_snapshot(char* data, size_t size, Dictionary* dict) {
+
+    DictionarySnapshot* header = (DictionarySnapshot*)data;
+    if (header->version != SNAPSHOT_VERSION || header->numWords == 0
+	    || header->numWords > INT32_MAX || size
+	    != sizeof(DictionarySnapshot) + sizeof(uint64_t)
+	    * (size_t)header->numWords) {
+	return false;
+    }
+    dict->numWords = header->numWords;
+    dict->slots = (uint64_t*)(data + sizeof(DictionarySnapshot));
+    return snapshot_checksum(dict->slots, sizeof(uint64_t) * dict->numWords,
+	    0xcbf29ce484222325ULL) == header->checksum;
+}
+
+// Function that runs the --compile-dictionary mode. Writes the given
+// dictionary to a snapshot file with the given name, which --dictionary
+// then maps instead of parsing. The snapshot is written to a temporary
+// file that is renamed over the name once complete, so a process mapping
+// the old snapshot is never affected.
+void write_dictionary_snapshot(Dictionary* dict, char* fileName) {
+
+    DictionarySnapshot header;
+    memset(&header, 0, sizeof(DictionarySnapshot));
+    memcpy(header.magic, SNAPSHOT_MAGIC, strlen(SNAPSHOT_MAGIC));
+    header.version = SNAPSHOT_VERSION;
+    header.numWords = dict->numWords;
+    header.checksum = snapshot_checksum(dict->slots,
+	    sizeof(uint64_t) * dict->numWords, 0xcbf29ce484222325ULL);
+    char* tempName = malloc(strlen(fileName) + 5);
+    sprintf(tempName, "%s.tmp", fileName);
+    FILE* out = fopen(tempName, "w");
+    if (out == NULL) {
+	snapshot_write_error(fileName);
+    }
+    fwrite(&header, sizeof(DictionarySnapshot), 1, out);
+    fwrite(dict->slots, sizeof(uint64_t), dict->numWords, out);
+    if (ferror(out) | fclose(out) || rename(tempName, fileName)) {
+	unlink(tempName);
+	snapshot_write_error(fileName);
+    }
+    free(tempName);
+}
+
+// Function that compares two entries of a salt's precomputed table for
+// qsort(), by fingerprint then word.
+int compare_table_entries(const void* a, const void* b) {
+
+    const TableEntry* first = (const TableEntry*)a;
+    const TableEntry* second = (const TableEntry*)b;
+    if (first->fingerprint != second->fingerprint) {
+	return first->fingerprint < second->fingerprint ? -1 : 1;
+    }
+    return first->word < second->word ? -1 : first->word > second->word;
+}
+
+// Thread function run by a --precompute thread. Takes in a void* which is
+// the TableBuild. Takes salts one at a time until every salt is taken, and
+// for each hashes the whole dictionary, sorts the table of fingerprints and
+// writes it to its place in the file. Returns NULL.
+void* build_salt_tables(void* ptr) {
+
+    TableBuild* build = (TableBuild*)ptr;
+    Dictionary* dict = build->dict;
+    const CryptBackend* backend = build->backend;
+    void* state = backend->create(backend);
+    uint64_t results[CRYPT_MAX_BATCH];
+    char salt[SALT_SIZE + 1];
+    size_t sectionSize = sizeof(TableEntry) * dict->numWords;
+    TableEntry* entries = malloc(sectionSize);
+    int index;
+    while ((index = __atomic_fetch_add(&build->nextSalt, 1,
+	    __ATOMIC_RELAXED)) < SALT_COMBINATIONS) {
+	salt[0] = CRYPT_ALPHABET[index & 63];
+	salt[1] = CRYPT_ALPHABET[index >> 6];
+	salt[2] = '\0';
+	backend->init_salt(state, salt);
+	for (int i = 0; i < dict->numWords; i += backend->batchSize) {
+	    int batch = dict->numWords - i < backend->batchSize
+		    ? dict->numWords - i : backend->batchSize;
+	    backend->hash_batch(state, dict->slots + i, batch, results);
+	    for (int j = 0; j < batch; j++) {
+		entries[i + j].fingerprint = results[j] >> 32;
+		entries[i + j].word = i + j;
 	    }
-	    break;
-	case 1:
-	    if (strlen(args[0]) != 13) {
-		// check ciphertext validity
-		result = false;
+	}
+	qsort(entries, dict->numWords, sizeof(TableEntry),
+		compare_table_entries);
+	size_t written = 0;
+	off_t offset = sizeof(TableHeader) + sectionSize * index;
+	while (written < sectionSize) {
+	    ssize_t count = pwrite(build->fd, (char*)entries + written,
+		    sectionSize - written, offset + written);
+	    if (count <= 0) {
+		build->failed = true;
 		break;
 	    }
-	    if (strchr(CHAR_SET, args[0][0]) == NULL 
-		    || strchr(CHAR_SET, args[0][1]) == NULL) {
-		result = false;
-	    }
-	    if (length == 2) {
-		valid = is_valid_number(args[1]);
-		// check thread number validity
-		if (valid != 0) {
-		    result = false;
-		}
-		threadCount = atoi(args[1]);
-		if (threadCount < 1 || threadCount > 50) {
-		    result = false;
-		}
-	    }
-	    break;
+	    written += count;
+	}
     }
-    return result;
+    free(entries);
+    free(state);
+    return NULL;
 }
 
-// Function to obtain the server socket on the given port. Takes in a port
-// number and attempts to gather address info. If successful it attempts to 
-// create a socket and bind it to the port then listen for incoming
-// connections. Returns the server socket.
-int get_serv_socket(const char* port) {
+// Function that runs the --precompute mode. Hashes the given dictionary
+// with every salt, using the given number of threads, and writes a file
+// of tables with the given name that --tables then maps: after the
+// header, one table per salt (in the order of the salt's 12 bits) of
+// every word's fingerprint - the top 32 bits of its raw crypt(3) result -
+// and index, sorted by fingerprint. Like a snapshot it is written to a
+// temporary file renamed over the name once complete. Prints the size of
+// the tables and the time taken to build them.
+void precompute_crack_tables(Dictionary* dict, const CryptBackend* backend,
+	char* fileName, int numThreads) {
 
-    struct addrinfo* ai = 0;
-    struct addrinfo hints;
-    memset(&hints, 0, sizeof(struct addrinfo));
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags = AI_PASSIVE;
+    TableHeader header;
+    TableBuild build = { .dict = dict, .backend = backend, .nextSalt = 0,
+	    .failed = false };
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    memset(&header, 0, sizeof(TableHeader));
+    memcpy(header.magic, TABLES_MAGIC, strlen(TABLES_MAGIC));
+    header.version = TABLES_VERSION;
+    header.numWords = dict->numWords;
+    header.checksum = snapshot_checksum(dict->slots,
+	    sizeof(uint64_t) * dict->numWords, 0xcbf29ce484222325ULL);
+    char* tempName = malloc(strlen(fileName) + 5);
+    sprintf(tempName, "%s.tmp", fileName);
+    build.fd = open(tempName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (build.fd < 0 || write(build.fd, &header, sizeof(TableHeader))
+	    != sizeof(TableHeader)) {
+	tables_error(fileName);
+    }
+    // Salts are claimed one at a time, so if a thread cannot be created
+    // the ones that were share its work
+    pthread_t* tids = malloc(sizeof(pthread_t) * numThreads);
+    int started = 1;
+    while (started < numThreads && pthread_create(&tids[started], NULL,
+	    build_salt_tables, &build) == 0) {
+	started++;
+    }
+    build_salt_tables(&build);
+    for (int i = 1; i < started; i++) {
+	pthread_join(tids[i], NULL);
+    }
+    free(tids);
+    if (build.failed | close(build.fd) || rename(tempName, fileName)) {
+	unlink(tempName);
+	tables_error(fileName);
+    }
+    free(tempName);
+    double seconds = seconds_since(&start);
+    printf("%i salts of %i words: %.1f MB of tables in %.2f seconds "
+	    "(%.0f crypts/sec)\n", SALT_COMBINATIONS, dict->numWords,
+	    (sizeof(TableHeader) + sizeof(TableEntry) * (double)dict->numWords
+	    * SALT_COMBINATIONS) / 1048576, seconds,
+	    (double)dict->numWords * SALT_COMBINATIONS / seconds);
+    fflush(stdout);
+}
 
-    int err;
-    if ((err = getaddrinfo(NULL, port, &hints, &ai))) {
-	freeaddrinfo(ai);
-	socket_open_error();
+// Function that maps the tables file with the given name, written by
+// --precompute for the given dictionary. Tables whose header or size does
+// not add up, or that were built from some other dictionary (by the
+// checksum of its words, which must also be in the same order), are never
+// used. Never exits, so a reload can go on without them. Returns the
+// tables, or NULL if they cannot be used.
+CrackTables* map_crack_tables(char* fileName, Dictionary* dict) {
+
+    struct stat info;
+    int fd = open(fileName, O_RDONLY);
+    if (fd < 0) {
+	return NULL;
     }
-    // create a socket and bind it to a port
-    int serv = socket(AF_INET, SOCK_STREAM, 0);
-    int optVal = 1;
-    if (setsockopt(serv, SOL_SOCKET, SO_REUSEADDR, &optVal, sizeof(int)) < 0) {
-	socket_open_error();
+    if (fstat(fd, &info) != 0 || info.st_size < sizeof(TableHeader)) {
+	close(fd);
+	return NULL;
     }
-    if (bind(serv, ai->ai_addr, sizeof(struct sockaddr))) {
-	socket_open_error();
+    char* data = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+	return NULL;
     }
-    if (listen(serv, 10) < 0) {	
-	socket_open_error();
+    TableHeader* header = (TableHeader*)data;
+    if (memcmp(header->magic, TABLES_MAGIC, strlen(TABLES_MAGIC)) != 0
+	    || header->version != TABLES_VERSION
+	    || header->numWords != dict->numWords
+	    || info.st_size != sizeof(TableHeader) + sizeof(TableEntry)
+	    * (size_t)header->numWords * SALT_COMBINATIONS
+	    || header->checksum != snapshot_checksum(dict->slots,
+	    sizeof(uint64_t) * dict->numWords, 0xcbf29ce484222325ULL)) {
+	munmap(data, info.st_size);
+	return NULL;
     }
-    // Get port number if supplied port was zero.
-    if (strcmp(port, "0") == 0) {
-	struct sockaddr_in ad;
-	memset(&ad, 0, sizeof(struct sockaddr_in));
-	socklen_t len = sizeof(struct sockaddr_in);
-	if (getsockname(serv, (struct sockaddr*)&ad, &len)) {
-	    socket_open_error();	
+    // Each lookup touches a few entries of one table
+    madvise(data, info.st_size, MADV_RANDOM);
+    CrackTables* tables = malloc(sizeof(CrackTables));
+    tables->data = data;
+    tables->size = info.st_size;
+    tables->numWords = header->numWords;
+    tables->entries = (TableEntry*)(data + sizeof(TableHeader));
+    return tables;
+}
+
+// Function that maps the tables file with the given name for the given
+// dictionary at startup. Prints the tables error message and exits if
+// they cannot be used, otherwise returns them.
+CrackTables* load_crack_tables(char* fileName, Dictionary* dict) {
+
+    CrackTables* tables = map_crack_tables(fileName, dict);
+    if (tables == NULL) {
+	tables_error(fileName);
+    }
+    return tables;
+}
+
+// Function that answers a client's crack request over the given dictionary
+// from its precomputed tables, if it has any. The entries of the salt's
+// table with the ciphertext's fingerprint are found by binary search, and
+// each is hashed in full with the client's crypt backend state - a
+// fingerprint is only part of the result. As the table has every word of
+// the dictionary, a request none of them match has failed. Sets found and
+// result. Returns false if the dictionary has no tables.
+bool lookup_crack_tables(ClientInfo* clientInfo, CrackWaiter* waiter,
+	Dictionary* dict) {
+
+    const CryptBackend* backend = clientInfo->pool->cryptBackend;
+    CrackTables* tables = dict->tables;
+    char salt[SALT_SIZE + 1];
+    uint32_t saltKey;
+    uint64_t result;
+    if (tables == NULL || !potfile_key(waiter->cipherText, &saltKey,
+	    &result)) {
+	return false;
+    }
+    const TableEntry* table = tables->entries
+	    + (size_t)(saltKey - 1) * tables->numWords;
+    uint32_t fingerprint = result >> 32;
+    int low = 0;
+    int high = tables->numWords;
+    while (low < high) {
+	int middle = low + (high - low) / 2;
+	if (table[middle].fingerprint < fingerprint) {
+	    low = middle + 1;
+	} else {
+	    high = middle;
 	}
-	// print port number obtained ad.sin_port
-	fprintf(stderr, "%u\n", ntohs(ad.sin_port));
-	fflush(stderr);
+    }
+    retrieve_salt(waiter->cipherText, salt);
+    void* state = NULL;
+    int calls = 0;
+    waiter->found = false;
+    for (int i = low; i < tables->numWords
+	    && table[i].fingerprint == fingerprint; i++) {
+	uint64_t slot = dict->slots[table[i].word];
+	uint64_t hashed;
+	if (state == NULL) {
+	    state = client_crypt_state(clientInfo, backend, salt);
+	}
+	backend->hash_batch(state, &slot, 1, &hashed);
+	calls++;
+	if (hashed == result) {
+	    waiter->found = true;
+	    unpack_word(slot, waiter->result);
+	    break;
+	}
+    }
+    update_crypt_calls(clientInfo->stats, calls);
+    return true;
+}
+
+// Function that frees the words of the given dictionary - the snapshot they
+// are in, or the slots they were loaded into - and unmaps its tables.
+void free_dictionary(Dictionary* dict) {
+
+    if (dict->snapshot && dict->snapshotMapped) {
+	munmap(dict->snapshot, dict->snapshotSize);
+    } else if (dict->snapshot) {
+	free(dict->snapshot);
     } else {
-	//print supplied port
-	fprintf(stderr, "%s\n", port);
-	fflush(stderr);
+	free(dict->slots);
+    }
+    if (dict->byLength) {
+	free(dict->byLength->slots);
+	free(dict->byLength);
+    }
+    if (dict->tables) {
+	munmap(dict->tables->data, dict->tables->size);
+	free(dict->tables);
     }
-    return serv;
 }
 
-// Function that retrieves the salt from the supplied cipherText argument.
-// Returns the salt.
-char* retrieve_salt(char* cipherText) {
-    
-    char* salt = malloc(sizeof(char) * (SALT_SIZE + 1));
-    salt[0] = cipherText[0];
-    salt[1] = cipherText[1];
-    salt[2] = '\0';
-    
-    return salt;
+// Function that returns the given dictionary's words grouped by length,
+// building them the first time. Requests racing to build them each build a
+// copy, the first to be stored is used and the others are freed.
+LengthBuckets* length_buckets(Dictionary* dict) {
+
+    LengthBuckets* buckets = __atomic_load_n(&dict->byLength,
+	    __ATOMIC_ACQUIRE);
+    if (buckets) {
+	return buckets;
+    }
+    int counts[MAX_PHRASE_SIZE + 1] = {0};
+    buckets = malloc(sizeof(LengthBuckets));
+    memset(buckets, 0, sizeof(LengthBuckets));
+    buckets->slots = malloc(sizeof(uint64_t) * dict->numWords);
+    for (int i = 0; i < dict->numWords; i++) {
+	counts[slot_length(dict->slots[i])]++;
+    }
+    for (int n = 0; n <= MAX_PHRASE_SIZE; n++) {
+	buckets->starts[n + 1] = buckets->starts[n] + counts[n];
+	counts[n] = buckets->starts[n];
+    }
+    for (int i = 0; i < dict->numWords; i++) {
+	buckets->slots[counts[slot_length(dict->slots[i])]++]
+		= dict->slots[i];
+    }
+    // A first word of length n goes with every word up to the rest
+    for (int n = 0; n <= MAX_PHRASE_SIZE; n++) {
+	buckets->groupPairs[n] = (long)(buckets->starts[n + 1]
+		- buckets->starts[n])
+		* buckets->starts[MAX_PHRASE_SIZE + 1 - n];
+	buckets->numPairs += buckets->groupPairs[n];
+    }
+    LengthBuckets* built = NULL;
+    if (!__atomic_compare_exchange_n(&dict->byLength, &built, buckets,
+	    false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+	free(buckets->slots);
+	free(buckets);
+	return built;
+    }
+    return buckets;
 }
 
-// Function that attempts to open a file from the given argument and read in
-// and store its contents. Returns a Dictionary struct containing all the
-// words read and the number of words found.
-Dictionary parse_dictionary(char* fileName) {
+// Function that returns the dictionary new crack requests use, with a
+// reference taken for the caller to release with release_dictionary().
+Dictionary* acquire_dictionary(DictionarySource* source) {
+
+    take_lock(&source->lock);
+    Dictionary* dict = source->current;
+    __atomic_add_fetch(&dict->refs, 1, __ATOMIC_RELAXED);
+    release_lock(&source->lock);
+    return dict;
+}
+
+// Function that drops a reference to the given dictionary, freeing it if
+// that was the last one.
+void release_dictionary(Dictionary* dict) {
+
+    if (__atomic_sub_fetch(&dict->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+	free_dictionary(dict);
+	free(dict);
+    }
+}
+
+// Function that starts reloading the source's dictionary file in the
+// background, unless a reload is already under way.
+void start_dictionary_reload(DictionarySource* source) {
+
+    pthread_t tid;
+    take_lock(&source->lock);
+    bool busy = source->reloading;
+    source->reloading = true;
+    release_lock(&source->lock);
+    if (busy) {
+	return;
+    }
+    if (pthread_create(&tid, NULL, reload_dictionary, source) != 0) {
+	take_lock(&source->lock);
+	source->reloading = false;
+	release_lock(&source->lock);
+	return;
+    }
+    pthread_detach(tid);
+}
+
+// Thread function run to reload a dictionary. Takes in a void* which is
+// the DictionarySource. Loads its file again while clients carry on with
+// the current dictionary, then swaps the new dictionary in for new crack
+// requests and drops the source's reference to the old one. If the file
+// cannot be used the current dictionary is kept. A dictionary with tables
+// keeps the file's order (the tables index its words) and has them mapped
+// again if they still match it. Returns NULL.
+void* reload_dictionary(void* ptr) {
+
+    DictionarySource* source = (DictionarySource*)ptr;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    Dictionary* dict = malloc(sizeof(Dictionary));
+    if (load_dictionary(source->fileName, dict,
+	    source->tablesName ? NULL : &source->hits) != 0) {
+	fprintf(stderr, "crackserver: unable to reload dictionary \"%s\"\n",
+		source->fileName);
+	free(dict);
+	take_lock(&source->lock);
+	source->failedReloads++;
+	source->reloading = false;
+	release_lock(&source->lock);
+	return NULL;
+    }
+    dict->refs = 1;
+    dict->hits = &source->hits;
+    if (source->tablesName && (dict->tables
+	    = map_crack_tables(source->tablesName, dict)) == NULL) {
+	fprintf(stderr, "crackserver: tables \"%s\" no longer match "
+		"dictionary \"%s\"\n", source->tablesName, source->fileName);
+    }
+    take_lock(&source->lock);
+    Dictionary* old = source->current;
+    source->current = dict;
+    source->reloads++;
+    source->reloadSeconds = seconds_since(&start);
+    source->previousWords = old->numWords;
+    source->reloading = false;
+    release_lock(&source->lock);
+    release_dictionary(old);
+    return NULL;
+}
+
+// Function that loads every dictionary given in the program parameters,
+// each distinct file once, the default dictionary being the one given.
+// Exits with the appropriate error message if one cannot be loaded.
+// Returns the DictionarySet holding them.
+DictionarySet* create_dictionary_set(ProgramParams params,
+	Dictionary dictionary) {
 
-    Dictionary dictionary = { .numWords = 0, .words = 0};
-    FILE* dict;
-    int numWords = 0;
-    char** words;
-    char* line;
-    if ((dict = fopen(fileName, "r")) == NULL) {
-	dictionary_open_error(fileName);
+    DictionarySet* set = malloc(sizeof(DictionarySet));
+    int count = params.numDictionaries;
+    set->numSources = 0;
+    set->sources = malloc(sizeof(DictionarySource*) * count);
+    set->numNames = 0;
+    set->names = malloc(sizeof(char*) * count);
+    set->named = malloc(sizeof(DictionarySource*) * count);
+    for (int i = 0; i < count; i++) {
+	NamedFile* option = &params.dictionaries[i];
+	DictionarySource* source = NULL;
+	for (int j = 0; j < set->numSources; j++) {
+	    if (!strcmp(set->sources[j]->fileName, option->fileName)) {
+		source = set->sources[j];
+	    }
+	}
+	if (source == NULL) {
+	    source = malloc(sizeof(DictionarySource));
+	    memset(source, 0, sizeof(DictionarySource));
+	    source->name = option->name;
+	    source->fileName = option->fileName;
+	    source->tablesName = i == 0 ? params.tablesName : NULL;
+	    source->current = malloc(sizeof(Dictionary));
+	    *source->current = i == 0 ? dictionary
+		    : parse_dictionary(option->fileName);
+	    source->current->refs = 1;
+	    source->current->hits = &source->hits;
+	    init_lock(&source->lock, 1);
+	    init_lock(&source->hits.lock, 1);
+	    set->sources[set->numSources++] = source;
+	}
+	if (option->name) {
+	    set->names[set->numNames] = option->name;
+	    set->named[set->numNames++] = source;
+	}
     }
-    words = malloc(sizeof(char*) * (numWords + 1));
-    while ((line = read_line(dict)) != NULL) {
-	if (line[strlen(line) - 1] == '\n') {
-	    line--;
+    return set;
+}
+
+// Function that loads every rule set given in the program parameters. A
+// rules file has a rule on each line, blank lines and lines starting with
+// '#' aside. Exits with the appropriate error message if a file cannot be
+// read, has an invalid rule or has no rules. Returns the rule sets.
+RuleSet* load_rule_sets(ProgramParams params) {
+
+    RuleSet* ruleSets = calloc(params.numRuleSets + 1, sizeof(RuleSet));
+    char line[RULE_LINE_SIZE];
+    for (int i = 0; i < params.numRuleSets; i++) {
+	RuleSet* set = &ruleSets[i];
+	char* fileName = params.ruleSets[i].fileName;
+	FILE* file = fopen(fileName, "r");
+	int lineNumber = 0;
+	int capacity = 16;
+	if (file == NULL) {
+	    rules_file_error(fileName, 0);
+	}
+	set->name = params.ruleSets[i].name;
+	set->rules = malloc(sizeof(Rule) * capacity);
+	set->identity = -1;
+	while (fgets(line, RULE_LINE_SIZE, file) != NULL) {
+	    lineNumber++;
+	    line[strcspn(line, "\r\n")] = '\0';
+	    if (line[strspn(line, " \t")] == '\0' || line[0] == '#') {
+		continue;
+	    }
+	    if (set->numRules == capacity) {
+		capacity *= 2;
+		set->rules = realloc(set->rules, sizeof(Rule) * capacity);
+	    }
+	    Rule* rule = &set->rules[set->numRules];
+	    if (!parse_rule(line, rule)) {
+		rules_file_error(fileName, lineNumber);
+	    }
+	    if (rule->numOps == 0 && set->identity < 0) {
+		set->identity = set->numRules;
+	    }
+	    set->numRules++;
 	}
-	if (strlen(line) > MAX_PHRASE_SIZE) {
+	fclose(file);
+	if (set->numRules == 0) {
+	    rules_file_error(fileName, 0);
+	}
+    }
+    return ruleSets;
+}
+
+// Function that parses a rule, in the rule syntax of common password
+// crackers, into rule. The commands understood are ':' (leave the word
+// alone), 'l', 'u' and 'c' (lower case, upper case and capitalise the
+// word), 't' and 'TN' (toggle the case of every character, or of the
+// character at position N), 'r' (reverse), '$X' and '^X' (append or
+// prepend character X), 'sXY' (substitute Y for every X, as in
+// leetspeak) and '\'N' (truncate to N characters). Spaces between
+// commands are ignored. Returns false if the rule is invalid.
+bool parse_rule(char* line, Rule* rule) {
+
+    rule->numOps = 0;
+    while (*line) {
+	char command = *line++;
+	RuleOp op = { .command = command, .arg1 = 0, .arg2 = 0 };
+	if (command == ' ' || command == '\t' || command == ':') {
 	    continue;
+	} else if (command == 'T' || command == '\'') {
+	    if (!isdigit(*line)) {
+		return false;
+	    }
+	    op.arg1 = *line++ - '0';
+	} else if (command == '$' || command == '^') {
+	    if (*line == '\0') {
+		return false;
+	    }
+	    op.arg1 = *line++;
+	} else if (command == 's') {
+	    if (line[0] == '\0' || line[1] == '\0') {
+		return false;
+	    }
+	    op.arg1 = *line++;
+	    op.arg2 = *line++;
+	} else if (!strchr("lucrt", command)) {
+	    return false;
+	}
+	if (rule->numOps == MAX_RULE_OPS) {
+	    return false;
+	}
+	rule->ops[rule->numOps++] = op;
+    }
+    return true;
+}
+
+// Function that returns the rule set with the given name, or NULL if there
+// is none.
+RuleSet* find_rule_set(WorkerPool* pool, char* name) {
+
+    for (int i = 0; i < pool->numRuleSets; i++) {
+	if (!strcmp(pool->ruleSets[i].name, name)) {
+	    return &pool->ruleSets[i];
+	}
+    }
+    return NULL;
+}
+
+// Function that returns true if the given crack request argument is a
+// keyspace mask rather than a name - if it has a '?' in it, or is a range
+// of lengths such as 1-4.
+bool is_mask(char* text) {
+
+    char* dash = strchr(text, '-');
+    return strchr(text, '?') || (dash && dash > text && dash[1] != '\0'
+	    && strspn(text, "0123456789-") == strlen(text));
+}
+
+// Function that parses a keyspace mask into mask. A mask is up to
+// MAX_PHRASE_SIZE positions, each '?l', '?u', '?d' or '?s' (a lower case
+// letter, upper case letter, digit, or '.' or '/'), '?a' (any character of
+// CHAR_SET), '??' (a '?') or any other character standing for itself.
+// Alternatively a range of lengths such as 1-4 is every word of CHAR_SET
+// characters with a length in the range. Returns false if the mask is
+// invalid.
+bool parse_mask(char* text, Mask* mask) {
+
+    int low;
+    int high;
+    int end = -1;
+    memset(mask, 0, sizeof(Mask));
+    if (strlen(text) > MAX_MASK_SIZE) {
+	return false;
+    }
+    strcpy(mask->text, text);
+    if (!strchr(text, '?')) {
+	if (sscanf(text, "%d-%d%n", &low, &high, &end) != 2
+		|| text[end] != '\0' || low < 0 || high < low
+		|| high > MAX_PHRASE_SIZE) {
+	    return false;
 	}
-	words[numWords++] = line;
-	words = realloc(words, sizeof(char*) * numWords + 1);
-	words[numWords] = '\0';
+	for (int length = low; length <= high; length++) {
+	    MaskPart part = { .length = length };
+	    for (int i = 0; i < length; i++) {
+		part.sets[i] = CHAR_SET;
+	    }
+	    add_mask_part(mask, &part);
+	}
+	return true;
+    }
+    MaskPart part = { .length = 0 };
+    while (*text) {
+	const char* set = NULL;
+	char literal = *text++;
+	if (part.length == MAX_PHRASE_SIZE) {
+	    return false;
+	}
+	if (literal == '?') {
+	    switch (*text++) {
+		case 'l':
+		    set = "abcdefghijklmnopqrstuvwxyz";
+		    break;
+		case 'u':
+		    set = "ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+		    break;
+		case 'd':
+		    set = "0123456789";
+		    break;
+		case 's':
+		    set = "./";
+		    break;
+		case 'a':
+		    set = CHAR_SET;
+		    break;
+		case '?':
+		    break;
+		default:
+		    return false;
+	    }
+	}
+	part.sets[part.length] = set;
+	part.literals[part.length++] = literal;
     }
-    if (list_length(words) == 0) {
-	dictionary_text_error();
+    add_mask_part(mask, &part);
+    return true;
+}
+
+// Function that works out the size of each position of the given part and
+// the number of candidates it holds, then adds it to the end of the mask.
+void add_mask_part(Mask* mask, MaskPart* part) {
+
+    part->numCandidates = 1;
+    for (int i = 0; i < part->length; i++) {
+	part->sizes[i] = part->sets[i] ? strlen(part->sets[i]) : 1;
+	part->numCandidates *= part->sizes[i];
     }
-    dictionary.words = words;
-    dictionary.numWords = numWords;
-    fclose(dict);
+    mask->parts[mask->numParts++] = *part;
+    mask->numCandidates += part->numCandidates;
+}
 
-    return dictionary;
+// Function that returns the dictionary with the given name, or the default
+// dictionary if name is NULL. Returns NULL if there is no such dictionary.
+DictionarySource* find_dictionary(DictionarySet* set, char* name) {
+
+    if (name == NULL) {
+	return set->sources[0];
+    }
+    for (int i = 0; i < set->numNames; i++) {
+	if (!strcmp(set->names[i], name)) {
+	    return set->named[i];
+	}
+    }
+    return NULL;
 }
     
 // Function that handles the processing of command line arguments.
@@ -699,14 +6724,26 @@ Dictionary parse_dictionary(char* fileName) {
 ProgramParams process_command_line(int argc, char* argv[]) {
 
     int portNum;
-    ProgramParams params = { .connections = 0, .port = "0", .fileName = 0};
+    ProgramParams params = { .connections = 0, .port = "0",
+	    .dictionaries = 0, .numDictionaries = 0, .ruleSets = 0,
+	    .numRuleSets = 0, .workers = 0,
+	    .benchmark = false, .backend = 0,
+	    .ioModel = IO_THREADS, .ioModelSet = false, .snapshotName = 0,
+	    .potfileName = 0, .importName = 0, .precomputeName = 0,
+	    .tablesName = 0};
 
     // Skip over the program name
     argc--;
     argv++;
 
-    while (argc >= 2 && argv[0][0] == '-') {
-	if (!strcmp(argv[0], "--maxconn") && params.connections == 0
+    while (argc >= 1 && argv[0][0] == '-') {
+	if (!strcmp(argv[0], "--benchmark") && !params.benchmark) {
+	    // The only option without a value
+	    params.benchmark = true;
+	    argc--;
+	    argv++;
+	    continue;
+	} else if (!strcmp(argv[0], "--maxconn") && params.connections == 0
 		&& argc >= 2) {
 	    if (is_valid_number(argv[1]) == 0) {
 		params.connections = atoi(argv[1]);
@@ -727,9 +6764,47 @@ ProgramParams process_command_line(int argc, char* argv[]) {
 		usage_error();
 	    }
 
-	} else if (!strcmp(argv[0], "--dictionary") && params.fileName == 0
+	} else if (!strcmp(argv[0], "--dictionary") && argc >= 2) {
+	    add_dictionary_option(&params, argv[1]);
+	} else if (!strcmp(argv[0], "--rules") && argc >= 2) {
+	    add_rules_option(&params, argv[1]);
+	} else if (!strcmp(argv[0], "--workers") && params.workers == 0
 		&& argc >= 2) {
-	    params.fileName = argv[1];
+	    if (is_valid_number(argv[1]) == 0 && atoi(argv[1]) > 0) {
+		params.workers = atoi(argv[1]);
+	    } else {
+		usage_error();
+	    }
+	} else if (!strcmp(argv[0], "--backend") && params.backend == 0
+		&& argc >= 2) {
+	    params.backend = argv[1];
+	} else if (!strcmp(argv[0], "--compile-dictionary")
+		&& params.snapshotName == 0 && argc >= 2) {
+	    params.snapshotName = argv[1];
+	} else if (!strcmp(argv[0], "--potfile") && params.potfileName == 0
+		&& argc >= 2) {
+	    params.potfileName = argv[1];
+	} else if (!strcmp(argv[0], "--import-potfile")
+		&& params.importName == 0 && argc >= 2) {
+	    params.importName = argv[1];
+	} else if (!strcmp(argv[0], "--precompute")
+		&& params.precomputeName == 0 && argc >= 2) {
+	    params.precomputeName = argv[1];
+	} else if (!strcmp(argv[0], "--tables") && params.tablesName == 0
+		&& argc >= 2) {
+	    params.tablesName = argv[1];
+	} else if (!strcmp(argv[0], "--io") && !params.ioModelSet
+		&& argc >= 2) {
+	    if (!strcmp(argv[1], "threads")) {
+		params.ioModel = IO_THREADS;
+	    } else if (!strcmp(argv[1], "epoll")) {
+		params.ioModel = IO_EPOLL;
+	    } else if (!strcmp(argv[1], "uring")) {
+		params.ioModel = IO_URING;
+	    } else {
+		usage_error();
+	    }
+	    params.ioModelSet = true;
 	} else {
 	    usage_error();
 	}
@@ -739,6 +6814,90 @@ ProgramParams process_command_line(int argc, char* argv[]) {
     if (argc != 0) {
 	usage_error();
     }
+    // Records can only be imported into a potfile
+    if (params.importName && !params.potfileName) {
+	usage_error();
+    }
+    if (params.numDictionaries == 0) {
+	add_dictionary_option(&params, "/usr/share/dict/words");
+    }
+    // A crack request's trailing names must say which is which
+    for (int i = 0; i < params.numRuleSets; i++) {
+	for (int j = 0; j < params.numDictionaries; j++) {
+	    char* name = params.dictionaries[j].name;
+	    if (name && !strcmp(name, params.ruleSets[i].name)) {
+		usage_error();
+	    }
+	}
+    }
 
     return params;
 }
+
+// Function that returns true if the given name can name a dictionary or
+// rule set - it is not empty, does not look like a thread count or a
+// keyspace mask, is not "+" and has no spaces.
+bool valid_option_name(char* name) {
+
+    return name[0] != '\0' && !strpbrk(name, " \t\n")
+	    && strspn(name, "0123456789") != strlen(name) && !is_mask(name)
+	    && strcmp(name, "+") != 0;
+}
+
+// Function that adds the dictionary given by a --dictionary argument to the
+// program parameters. The argument is a file name, or name=file for a
+// dictionary that crack requests select by name. A name must not look
+// like a thread count or contain spaces, and may only be given once, as
+// may a dictionary without a name - which goes first, so it is the
+// default dictionary. Otherwise prints the usage error message and exits.
+void add_dictionary_option(ProgramParams* params, char* arg) {
+
+    NamedFile option = { .name = 0, .fileName = arg };
+    char* equals = strchr(arg, '=');
+    if (equals && memchr(arg, '/', equals - arg) == NULL) {
+	option.name = strndup(arg, equals - arg);
+	option.fileName = equals + 1;
+	if (!valid_option_name(option.name) || option.fileName[0] == '\0') {
+	    usage_error();
+	}
+    }
+    for (int i = 0; i < params->numDictionaries; i++) {
+	char* name = params->dictionaries[i].name;
+	if (option.name ? name && !strcmp(name, option.name) : !name) {
+	    usage_error();
+	}
+    }
+    params->dictionaries = realloc(params->dictionaries,
+	    sizeof(NamedFile) * (params->numDictionaries + 1));
+    if (option.name) {
+	params->dictionaries[params->numDictionaries++] = option;
+	return;
+    }
+    memmove(params->dictionaries + 1, params->dictionaries,
+	    sizeof(NamedFile) * params->numDictionaries++);
+    params->dictionaries[0] = option;
+}
+
+// Function that adds the rule set given by a --rules argument, name=file,
+// to the program parameters. Each name may only be given once. Otherwise
+// prints the usage error message and exits.
+void add_rules_option(ProgramParams* params, char* arg) {
+
+    char* equals = strchr(arg, '=');
+    if (equals == NULL || equals[1] == '\0') {
+	usage_error();
+    }
+    NamedFile option = { .name = strndup(arg, equals - arg),
+	    .fileName = equals + 1 };
+    if (!valid_option_name(option.name)) {
+	usage_error();
+    }
+    for (int i = 0; i < params->numRuleSets; i++) {
+	if (!strcmp(params->ruleSets[i].name, option.name)) {
+	    usage_error();
+	}
+    }
+    params->ruleSets = realloc(params->ruleSets,
+	    sizeof(NamedFile) * (params->numRuleSets + 1));
+    params->ruleSets[params->numRuleSets++] = option;
+}